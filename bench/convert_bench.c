@@ -0,0 +1,122 @@
+#include "convert.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_SAMPLES (1 << 20)
+#define ROUNDS 256
+
+typedef void (*convert_fn)(uint8_t *out, const uint8_t *in,
+                           size_t num_samples);
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Converts every 16 bit value with "fn", out of place and in place, at each
+ * length up to 100 samples and each alignment up to 32 bytes, and compares
+ * the bytes against sample / 257.  Returns true if every result matched.
+ */
+static bool check(convert_fn fn) {
+  uint8_t *in = malloc(65536 * 2 + 64);
+  uint8_t *work = malloc(65536 * 2 + 64);
+  uint8_t *out = malloc(65536 + 64);
+  if (!in || !work || !out) {
+    fprintf(stderr, "Error allocating memory\n");
+    exit(1);
+  }
+  bool ok = true;
+  for (size_t offset = 0; offset < 32 && ok; offset++) {
+    uint8_t *src = in + offset;
+    for (uint32_t v = 0; v < 65536; v++) {
+      src[v * 2] = (uint8_t)(v >> 8);
+      src[v * 2 + 1] = (uint8_t)v;
+    }
+    // every value in one go, out of place and in place
+    fn(out + offset, src, 65536);
+    memcpy(work + offset, src, 65536 * 2);
+    fn(work + offset, work + offset, 65536);
+    for (uint32_t v = 0; v < 65536; v++) {
+      if (out[offset + v] != v / 257 || work[offset + v] != v / 257) {
+        ok = false;
+        break;
+      }
+    }
+    // short runs, to cover the scalar tails
+    for (size_t len = 0; len <= 100 && ok; len++) {
+      size_t start = (len * 7919) % (65536 - len);
+      memset(out, 0xAA, len + 64);
+      fn(out + offset, src + start * 2, len);
+      for (size_t i = 0; i < len; i++) {
+        if (out[offset + i] != (start + i) / 257) {
+          ok = false;
+        }
+      }
+      if (out[offset + len] != 0xAA) {
+        // wrote past the end
+        ok = false;
+      }
+    }
+  }
+  free(in);
+  free(work);
+  free(out);
+  return ok;
+}
+
+/**
+ * Converts NUM_SAMPLES samples ROUNDS times and prints the throughput, in
+ * 16 bit input bytes, of the best of three runs.  Returns false if "fn"
+ * got any value wrong.
+ */
+static bool run(const char *name, convert_fn fn, const uint8_t *in,
+                uint8_t *out) {
+  double best = 1e30;
+  for (int attempt = 0; attempt < 3; attempt++) {
+    double s0 = seconds();
+    for (int r = 0; r < ROUNDS; r++) {
+      fn(out, in, NUM_SAMPLES);
+    }
+    double s1 = seconds();
+    if (s1 - s0 < best) {
+      best = s1 - s0;
+    }
+  }
+  double bytes = (double)NUM_SAMPLES * 2 * ROUNDS;
+  bool ok = check(fn);
+  printf("%-9s %10.1f%s\n", name, bytes / best / 1e6,
+         ok ? "" : "  WRONG RESULT");
+  return ok;
+}
+
+int main(void) {
+  uint8_t *in = malloc(NUM_SAMPLES * 2);
+  uint8_t *out = malloc(NUM_SAMPLES);
+  if (!in || !out) {
+    fprintf(stderr, "Error allocating memory\n");
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < NUM_SAMPLES * 2; i++) {
+    in[i] = (uint8_t)rand();
+  }
+
+  printf("default kernel: %s\n", convert_kernel_level());
+  printf("%-9s %10s\n", "kernel", "MB/s");
+  bool ok = run("scalar", convert_16_to_8_scalar, in, out);
+  if (convert_sse2_supported()) {
+    ok &= run("sse2", convert_16_to_8_sse2, in, out);
+  }
+  if (convert_avx2_supported()) {
+    ok &= run("avx2", convert_16_to_8_avx2, in, out);
+  }
+  ok &= run("default", convert_16_to_8, in, out);
+  free(in);
+  free(out);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+#include "crc.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BUF_SIZE (1 << 20)
+#define ROUNDS 64
+#define CHECK_LEN 300
+#define CHECK_OFFSETS 16
+
+typedef unsigned long (*crc_fn)(unsigned long crc, const unsigned char *buf,
+                                size_t len);
+
+static uint64_t cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Compares "fn" with the bytewise engine for every length up to CHECK_LEN at
+ * each start offset up to CHECK_OFFSETS, which covers the tails and
+ * misaligned starts the timed runs never hit.  Each length is also run from
+ * a register that isn't the initial 0xffffffff, as for the later pieces of
+ * a chunk.  Returns false if any result differed.
+ */
+static bool check(const char *name, crc_fn fn, const unsigned char *buf) {
+  bool ok = true;
+  for (size_t offset = 0; offset < CHECK_OFFSETS; offset++) {
+    for (size_t len = 0; len <= CHECK_LEN; len++) {
+      const unsigned char *p = buf + offset;
+      unsigned long start[2] = {0xffffffffL, 0x12345678L ^ len};
+      for (int i = 0; i < 2; i++) {
+        if (fn(start[i], p, len) != update_crc_bytewise(start[i], p, len)) {
+          printf("%-9s offset %zu, %zu bytes  WRONG RESULT\n", name, offset,
+                 len);
+          ok = false;
+        }
+      }
+    }
+  }
+  return ok;
+}
+
+/**
+ * CRCs the buffer ROUNDS times in pieces of "chunk" bytes, like a run of
+ * chunks of that size, and prints throughput for the best of three runs.
+ * Returns false if the result was wrong.
+ */
+static bool run(const char *name, crc_fn fn, const unsigned char *buf,
+                size_t chunk, unsigned long expect) {
+  double best_s = 1e30;
+  uint64_t best_c = UINT64_MAX;
+  unsigned long c = 0;
+  for (int attempt = 0; attempt < 3; attempt++) {
+    double s0 = seconds();
+    uint64_t c0 = cycles();
+    for (int r = 0; r < ROUNDS; r++) {
+      c = 0xffffffffL;
+      for (size_t off = 0; off < BUF_SIZE; off += chunk) {
+        size_t n = BUF_SIZE - off < chunk ? BUF_SIZE - off : chunk;
+        c = fn(c, buf + off, n);
+      }
+    }
+    uint64_t c1 = cycles();
+    double s1 = seconds();
+    if (s1 - s0 < best_s) {
+      best_s = s1 - s0;
+      best_c = c1 - c0;
+    }
+  }
+  double bytes = (double)BUF_SIZE * ROUNDS;
+  bool ok = (c ^ 0xffffffffL) == expect;
+  printf("%-9s %8zu %10.3f %10.1f%s\n", name, chunk,
+         best_c ? bytes / (double)best_c : 0.0, bytes / best_s / 1e6,
+         ok ? "" : "  WRONG RESULT");
+  return ok;
+}
+
+int main(void) {
+  unsigned char *buf = malloc(BUF_SIZE);
+  if (!buf) {
+    fprintf(stderr, "Error allocating memory\n");
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < BUF_SIZE; i++) {
+    buf[i] = (unsigned char)rand();
+  }
+  unsigned long expect = crc(buf, BUF_SIZE);
+
+  printf("default engine: %s\n", crc_engine());
+  bool ok = check("slice8", update_crc_slice8, buf);
+  if (crc_pclmul_supported()) {
+    ok &= check("pclmul", update_crc_pclmul, buf);
+  }
+  ok &= check("zlib", update_crc_zlib, buf);
+  ok &= check("default", update_crc, buf);
+
+  printf("%-9s %8s %10s %10s\n", "engine", "chunk", "bytes/cyc", "MB/s");
+  static const size_t chunks[] = {64, 8192, BUF_SIZE};
+  for (int i = 0; i < 3; i++) {
+    ok &= run("bytewise", update_crc_bytewise, buf, chunks[i], expect);
+    ok &= run("slice8", update_crc_slice8, buf, chunks[i], expect);
+    if (crc_pclmul_supported()) {
+      ok &= run("pclmul", update_crc_pclmul, buf, chunks[i], expect);
+    }
+    ok &= run("zlib", update_crc_zlib, buf, chunks[i], expect);
+  }
+  free(buf);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,528 @@
+#include "png.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/**
+ * Decode benchmark over a corpus generated in memory: every color type and
+ * bit depth, each filter type forced on every row plus a mix of all five,
+ * sizes from icons up, and interlaced images.  Reports output MB/s for the
+ * whole decode and for each stage, from the decoder's own PNG_Stats.
+ */
+
+#define IDAT_SIZE 8192
+#define FILTER_MIXED 5
+
+typedef struct {
+  const char *name;
+  uint8_t color_type;
+  uint8_t bit_depth;
+} FORMAT;
+
+static const FORMAT formats[] = {
+    {"gray1", 0, 1},    {"gray2", 0, 2},    {"gray4", 0, 4},
+    {"gray8", 0, 8},    {"gray16", 0, 16},  {"rgb8", 2, 8},
+    {"rgb16", 2, 16},   {"pal1", 3, 1},     {"pal2", 3, 2},
+    {"pal4", 3, 4},     {"pal8", 3, 8},     {"graya8", 4, 8},
+    {"graya16", 4, 16}, {"rgba8", 6, 8},    {"rgba16", 6, 16},
+};
+#define NUM_FORMATS (sizeof(formats) / sizeof(formats[0]))
+
+static const char *filter_names[] = {"none",  "sub",   "up",
+                                     "avg",   "paeth", "mixed"};
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t cap;
+} BUFFER;
+
+typedef struct {
+  bool quick;
+  bool huge;
+  const char *match;
+  double min_time;
+} BENCH_OPTS;
+
+static bool append(BUFFER *b, const void *data, size_t len) {
+  if (b->size + len > b->cap) {
+    size_t cap = b->cap ? b->cap : 65536;
+    while (cap < b->size + len) {
+      cap *= 2;
+    }
+    uint8_t *tmp = realloc(b->data, cap);
+    if (!tmp) {
+      return false;
+    }
+    b->data = tmp;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->size, data, len);
+  b->size += len;
+  return true;
+}
+
+static bool append_u32(BUFFER *b, uint32_t v) {
+  uint8_t be[4] = {(uint8_t)(v >> 24), (uint8_t)(v >> 16), (uint8_t)(v >> 8),
+                   (uint8_t)v};
+  return append(b, be, 4);
+}
+
+static bool write_chunk(BUFFER *b, const char *type, const uint8_t *data,
+                        uint32_t len) {
+  uLong c = crc32(0L, (const Bytef *)type, 4);
+  if (len > 0) {
+    c = crc32(c, data, len);
+  }
+  return append_u32(b, len) && append(b, type, 4) &&
+         (len == 0 || append(b, data, len)) && append_u32(b, (uint32_t)c);
+}
+
+static int channels(const FORMAT *f) {
+  switch (f->color_type) {
+  case 2:
+    return 3;
+  case 4:
+    return 2;
+  case 6:
+    return 4;
+  default:
+    return 1;
+  }
+}
+
+/**
+ * A smooth gradient with a little noise, so the data compresses about as
+ * well as a photo rather than to nothing.
+ */
+static uint32_t sample(const FORMAT *f, uint32_t x, uint32_t y, int c) {
+  uint32_t max = (1u << f->bit_depth) - 1;
+  uint32_t h = (x * 2654435761u) ^ (y * 2246822519u) ^ ((uint32_t)c << 29);
+  h ^= h >> 15;
+  uint32_t v = ((x + y) * 4 + (uint32_t)c * 64) + (h & 7);
+  if (f->bit_depth == 16) {
+    v = v * 97 + (h & 0xff);
+  }
+  return v & max;
+}
+
+/**
+ * Sets "rgb" to palette entry "i" of a palette image.
+ */
+static void palette_entry(const FORMAT *f, uint32_t i, uint8_t *rgb) {
+  uint32_t entries = 1u << f->bit_depth;
+  rgb[0] = (uint8_t)(i * 255 / (entries - 1));
+  rgb[1] = (uint8_t)(255 - i * 255 / (entries - 1));
+  rgb[2] = (uint8_t)(i * 37);
+}
+
+/**
+ * Scales sample "v" to 8 bits the way the decoder does: bit replication
+ * below 8 bits, which is the same as v * 255 / max, and / 257 for 16.
+ */
+static uint8_t to_8_bits(const FORMAT *f, uint32_t v) {
+  if (f->bit_depth == 16) {
+    return (uint8_t)(v / 257);
+  }
+  return (uint8_t)(v * 255 / ((1u << f->bit_depth) - 1));
+}
+
+/**
+ * Compares the decoded "img", expanded to 8 bit RGB(A) as the decoder does
+ * by default, with the samples it was encoded from.  Returns false, having
+ * said where, on the first pixel that differs.
+ */
+static bool check_pixels(const char *name, const FORMAT *f, const PNG *img) {
+  uint32_t width = img->header->width;
+  uint32_t height = img->header->height;
+  int out_channels = f->color_type == 4 || f->color_type == 6 ? 4 : 3;
+  if (PNG_channels(img) != out_channels || PNG_depth(img) != 8) {
+    printf("%-22s decoded to %d channels of %d bits  WRONG RESULT\n", name,
+           PNG_channels(img), PNG_depth(img));
+    return false;
+  }
+  for (uint32_t y = 0; y < height; y++) {
+    const uint8_t *row = img->pixels + (size_t)y * img->stride;
+    for (uint32_t x = 0; x < width; x++) {
+      uint8_t expect[4];
+      switch (f->color_type) {
+      case 3:
+        palette_entry(f, sample(f, x, y, 0), expect);
+        break;
+      case 0:
+      case 4:
+        expect[0] = to_8_bits(f, sample(f, x, y, 0));
+        expect[1] = expect[0];
+        expect[2] = expect[0];
+        expect[3] = to_8_bits(f, sample(f, x, y, 1));
+        break;
+      default:
+        for (int c = 0; c < out_channels; c++) {
+          expect[c] = to_8_bits(f, sample(f, x, y, c));
+        }
+        break;
+      }
+      if (memcmp(row + (size_t)x * out_channels, expect,
+                 (size_t)out_channels) != 0) {
+        printf("%-22s pixel (%u, %u) differs  WRONG RESULT\n", name, x, y);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Packs "count" pixels of row "y", at x = x0, x0 + dx, ..., into "out".
+ */
+static void pack_row(uint8_t *out, const FORMAT *f, uint32_t y, uint32_t x0,
+                     uint32_t dx, uint32_t count) {
+  int nc = channels(f);
+  size_t bit = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t x = x0 + i * dx;
+    for (int c = 0; c < nc; c++) {
+      uint32_t v = sample(f, x, y, c);
+      if (f->bit_depth == 16) {
+        out[bit / 8] = (uint8_t)(v >> 8);
+        out[bit / 8 + 1] = (uint8_t)v;
+      } else if (f->bit_depth == 8) {
+        out[bit / 8] = (uint8_t)v;
+      } else {
+        int shift = 8 - f->bit_depth - (int)(bit % 8);
+        out[bit / 8] |= (uint8_t)(v << shift);
+      }
+      bit += f->bit_depth;
+    }
+  }
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+  int p = (int)a + (int)b - (int)c;
+  int pa = abs(p - (int)a);
+  int pb = abs(p - (int)b);
+  int pc = abs(p - (int)c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+/**
+ * Filters "raw" into out[1..len] with filter "type", out[0] being the type.
+ * "prior" is the previous raw row of the same pass, NULL for the first.
+ */
+static void filter_row(uint8_t *out, const uint8_t *raw, const uint8_t *prior,
+                       size_t len, size_t bpp, int type) {
+  out[0] = (uint8_t)type;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t a = i >= bpp ? raw[i - bpp] : 0;
+    uint8_t b = prior ? prior[i] : 0;
+    uint8_t c = prior && i >= bpp ? prior[i - bpp] : 0;
+    uint8_t pred = 0;
+    switch (type) {
+    case 1:
+      pred = a;
+      break;
+    case 2:
+      pred = b;
+      break;
+    case 3:
+      pred = (uint8_t)(((int)a + (int)b) / 2);
+      break;
+    case 4:
+      pred = paeth(a, b, c);
+      break;
+    }
+    out[i + 1] = (uint8_t)(raw[i] - pred);
+  }
+}
+
+/**
+ * Streams rows through deflate, cutting the output into IDAT chunks of
+ * IDAT_SIZE bytes the way libpng does by default.
+ */
+typedef struct {
+  z_stream zs;
+  uint8_t zbuf[IDAT_SIZE];
+  BUFFER *png;
+} IDAT_WRITER;
+
+static bool deflate_into(IDAT_WRITER *w, const uint8_t *data, size_t len,
+                         int flush) {
+  w->zs.next_in = (Bytef *)data;
+  w->zs.avail_in = (uInt)len;
+  do {
+    int r = deflate(&w->zs, flush);
+    if (r == Z_STREAM_ERROR) {
+      return false;
+    }
+    uint32_t n = IDAT_SIZE - w->zs.avail_out;
+    if (w->zs.avail_out == 0 || (r == Z_STREAM_END && n > 0)) {
+      if (!write_chunk(w->png, "IDAT", w->zbuf, n)) {
+        return false;
+      }
+      w->zs.next_out = w->zbuf;
+      w->zs.avail_out = IDAT_SIZE;
+    }
+    if (r == Z_STREAM_END) {
+      return true;
+    }
+  } while (w->zs.avail_in > 0 || flush == Z_FINISH);
+  return true;
+}
+
+/**
+ * Encodes a synthetic png into "out".
+ */
+static bool encode_png(BUFFER *out, const FORMAT *f, uint32_t width,
+                       uint32_t height, int filter, bool interlace) {
+  static const uint8_t sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  uint8_t ihdr[13];
+  uint32_t dims[2] = {width, height};
+  for (int i = 0; i < 2; i++) {
+    ihdr[i * 4] = (uint8_t)(dims[i] >> 24);
+    ihdr[i * 4 + 1] = (uint8_t)(dims[i] >> 16);
+    ihdr[i * 4 + 2] = (uint8_t)(dims[i] >> 8);
+    ihdr[i * 4 + 3] = (uint8_t)dims[i];
+  }
+  ihdr[8] = f->bit_depth;
+  ihdr[9] = f->color_type;
+  ihdr[10] = 0;
+  ihdr[11] = 0;
+  ihdr[12] = interlace ? 1 : 0;
+  out->size = 0;
+  if (!append(out, sig, 8) || !write_chunk(out, "IHDR", ihdr, 13)) {
+    return false;
+  }
+  if (f->color_type == 3) {
+    uint8_t plte[256 * 3];
+    uint32_t entries = 1u << f->bit_depth;
+    for (uint32_t i = 0; i < entries; i++) {
+      palette_entry(f, i, plte + i * 3);
+    }
+    if (!write_chunk(out, "PLTE", plte, entries * 3)) {
+      return false;
+    }
+  }
+
+  size_t bits = (size_t)channels(f) * f->bit_depth;
+  size_t bpp = bits < 8 ? 1 : bits / 8;
+  size_t max_len = ((size_t)width * bits + 7) / 8;
+  uint8_t *rows[2] = {malloc(max_len + 1), malloc(max_len + 1)};
+  uint8_t *filtered = malloc(max_len + 1);
+  IDAT_WRITER *w = calloc(1, sizeof(IDAT_WRITER));
+  bool ok = rows[0] && rows[1] && filtered && w &&
+            deflateInit(&w->zs, Z_DEFAULT_COMPRESSION) == Z_OK;
+  if (ok) {
+    w->png = out;
+    w->zs.next_out = w->zbuf;
+    w->zs.avail_out = IDAT_SIZE;
+  }
+
+  // Adam7 passes: x0, y0, dx, dy.  Non-interlaced is one pass of everything.
+  static const uint32_t adam7[7][4] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8},
+                                       {2, 0, 4, 4}, {0, 2, 2, 4}, {1, 0, 2, 2},
+                                       {0, 1, 1, 2}};
+  static const uint32_t single[1][4] = {{0, 0, 1, 1}};
+  const uint32_t(*passes)[4] = interlace ? adam7 : single;
+  int num_passes = interlace ? 7 : 1;
+  for (int p = 0; ok && p < num_passes; p++) {
+    uint32_t x0 = passes[p][0], y0 = passes[p][1];
+    uint32_t dx = passes[p][2], dy = passes[p][3];
+    if (x0 >= width || y0 >= height) {
+      continue;
+    }
+    uint32_t count = (width - x0 + dx - 1) / dx;
+    size_t len = ((size_t)count * bits + 7) / 8;
+    uint32_t row = 0;
+    for (uint32_t y = y0; ok && y < height; y += dy, row++) {
+      uint8_t *raw = rows[row & 1];
+      const uint8_t *prior = row ? rows[(row - 1) & 1] : NULL;
+      memset(raw, 0, len);
+      pack_row(raw, f, y, x0, dx, count);
+      int type = filter == FILTER_MIXED ? (int)(row % 5) : filter;
+      filter_row(filtered, raw, prior, len, bpp, type);
+      ok = deflate_into(w, filtered, len + 1, Z_NO_FLUSH);
+    }
+  }
+  ok = ok && deflate_into(w, NULL, 0, Z_FINISH) &&
+       write_chunk(out, "IEND", NULL, 0);
+  if (w) {
+    deflateEnd(&w->zs);
+  }
+  free(w);
+  free(filtered);
+  free(rows[0]);
+  free(rows[1]);
+  return ok;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t ns) {
+  return ns ? (double)bytes / 1e6 / ((double)ns / 1e9) : 0.0;
+}
+
+/**
+ * Decodes "png", made from the samples of format "f", over and over for at
+ * least "min_time" seconds and prints a line of results.  Stats are added to
+ * "total".  The first decode is checked against the samples.
+ * Returns false if the pixels were wrong, an image that can't be decoded
+ * isn't counted as wrong.
+ */
+static bool run_case(const char *name, const FORMAT *f, const BUFFER *png,
+                     uint32_t width, uint32_t height, double min_time,
+                     PNG_Stats *total) {
+  PNG_Stats stats;
+  PNG_stats_reset(&stats);
+  PNG_Options opts;
+  PNG_default_options(&opts);
+  opts.stats = &stats;
+  PNG_Decoder *dec = PNG_decoder_new(&opts);
+  if (!dec) {
+    return true;
+  }
+
+  char size[32];
+  snprintf(size, sizeof(size), "%ux%u", width, height);
+  uint64_t out_bytes = 0;
+  uint64_t min_ns = (uint64_t)(min_time * 1e9);
+  uint64_t start = PNG_stats_clock();
+  int iterations = 0;
+  do {
+    PNG *img = PNG_decoder_decode_memory(dec, png->data, png->size);
+    if (!img) {
+      printf("%-22s %11s  unsupported or failed to decode\n", name, size);
+      PNG_decoder_free(dec);
+      return true;
+    }
+    if (iterations == 0 && !check_pixels(name, f, img)) {
+      free_PNG(img);
+      PNG_decoder_free(dec);
+      return false;
+    }
+    out_bytes +=
+        (uint64_t)img->header->width * img->header->height * PNG_channels(img);
+    free_PNG(img);
+    iterations++;
+  } while (PNG_stats_clock() - start < min_ns);
+  PNG_decoder_free(dec);
+
+  printf("%-22s %11s %6d %9.1f", name, size, iterations,
+         mb_per_s(out_bytes, stats.total_ns));
+  for (int s = PNG_STAGE_PARSE; s <= PNG_STAGE_EXPAND; s++) {
+    const PNG_StageStats *st = &stats.stages[s];
+    if (st->bytes == 0) {
+      printf(" %9s", "-");
+    } else {
+      printf(" %9.1f", mb_per_s(st->bytes, st->ns));
+    }
+  }
+  printf("\n");
+  PNG_stats_merge(total, &stats);
+  return true;
+}
+
+/**
+ * Runs every case for format "f".  Returns false if any decoded wrongly.
+ */
+static bool bench_format(const FORMAT *f, const BENCH_OPTS *opts,
+                         BUFFER *png, PNG_Stats *total) {
+  bool ok = true;
+  // every filter on small and medium images, the mix on the larger ones
+  static const uint32_t filter_sizes[] = {16, 512};
+  char name[64];
+  for (size_t s = 0; s < sizeof(filter_sizes) / sizeof(filter_sizes[0]);
+       s++) {
+    uint32_t n = filter_sizes[s];
+    for (int filter = 0; filter <= FILTER_MIXED; filter++) {
+      if (opts->quick && filter != FILTER_MIXED) {
+        continue;
+      }
+      snprintf(name, sizeof(name), "%s/%s", f->name, filter_names[filter]);
+      if (opts->match && !strstr(name, opts->match)) {
+        continue;
+      }
+      if (!encode_png(png, f, n, n, filter, false)) {
+        printf("%-22s failed to encode\n", name);
+        continue;
+      }
+      ok &= run_case(name, f, png, n, n, opts->min_time, total);
+    }
+  }
+
+  struct {
+    uint32_t size;
+    bool interlace;
+    bool wanted;
+  } extra[] = {
+      {2048, false, !opts->quick},
+      {512, true, true},
+      {16384, false, opts->huge && f->bit_depth == 8 &&
+                         (f->color_type == 0 || f->color_type == 6)},
+  };
+  for (size_t i = 0; i < sizeof(extra) / sizeof(extra[0]); i++) {
+    if (!extra[i].wanted) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s/mixed%s", f->name,
+             extra[i].interlace ? "/adam7" : "");
+    if (opts->match && !strstr(name, opts->match)) {
+      continue;
+    }
+    uint32_t n = extra[i].size;
+    if (!encode_png(png, f, n, n, FILTER_MIXED, extra[i].interlace)) {
+      printf("%-22s failed to encode\n", name);
+      continue;
+    }
+    ok &= run_case(name, f, png, n, n, opts->min_time, total);
+  }
+  return ok;
+}
+
+static void print_usage(void) {
+  printf("Usage: pnger_bench [options]\n");
+  printf("Options:\n");
+  printf("  --quick         Only the mixed filter, up to 512x512.\n");
+  printf("  --huge          Also decode 16384x16384 gray8 and rgba8.\n");
+  printf("  --match=<text>  Only cases whose name contains text.\n");
+  printf("  --time=<s>      Minimum time per case, default 0.1 seconds.\n");
+}
+
+int main(int argc, char **argv) {
+  BENCH_OPTS opts = {false, false, NULL, 0.1};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      opts.quick = true;
+      opts.min_time = 0.02;
+    } else if (strcmp(argv[i], "--huge") == 0) {
+      opts.huge = true;
+    } else if (strncmp(argv[i], "--match=", 8) == 0) {
+      opts.match = argv[i] + 8;
+    } else if (strncmp(argv[i], "--time=", 7) == 0) {
+      opts.min_time = atof(argv[i] + 7);
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  printf("MB/s of decoded output for the whole decode, then of the bytes each "
+         "stage consumed.\n");
+  printf("%-22s %11s %6s %9s %9s %9s %9s %9s %9s %9s\n", "case", "size", "iter",
+         "total", "parse", "crc", "inflate", "unfilter", "convert16",
+         "expand");
+  BUFFER png = {0};
+  PNG_Stats total;
+  PNG_stats_reset(&total);
+  bool ok = true;
+  for (size_t i = 0; i < NUM_FORMATS; i++) {
+    ok &= bench_format(&formats[i], &opts, &png, &total);
+  }
+  free(png.data);
+
+  printf("\nAll cases:\n");
+  PNG_stats_print(&total, stdout, false);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+// heap blocks are at least this big, larger requests get a block of their own
+#define ARENA_BLOCK_SIZE 4096
+
+typedef struct BLOCK BLOCK;
+
+/**
+ * Header of a malloc'd block, the allocations follow it.  Field "prev" is
+ * the block allocated before this one.
+ */
+struct BLOCK {
+  BLOCK *prev;
+};
+
+/**
+ * Allocations are carved from [next, end) of the current block.  Field
+ * "blocks" lists the malloc'd blocks, newest first.  Field "on_heap" is set
+ * when the arena itself was malloc'd rather than placed in backing memory.
+ * Field "heap_allocs" counts both.
+ */
+struct ARENA {
+  unsigned char *next;
+  unsigned char *end;
+  BLOCK *blocks;
+  bool on_heap;
+  size_t heap_allocs;
+};
+
+static unsigned char *align_up(unsigned char *p) {
+  uintptr_t mask = ARENA_ALIGN - 1;
+  return (unsigned char *)(((uintptr_t)p + mask) & ~mask);
+}
+
+/**
+ * Returns true if "size" bytes fit in the current block after alignment.
+ */
+static bool fits(const ARENA *arena, size_t size) {
+  unsigned char *p = align_up(arena->next);
+  return p <= arena->end && size <= (size_t)(arena->end - p);
+}
+
+/**
+ * Starts a new heap block with room for at least "size" aligned bytes.  What
+ * was left of the current block is abandoned.
+ */
+static bool add_block(ARENA *arena, size_t size) {
+  if (size < ARENA_BLOCK_SIZE) {
+    size = ARENA_BLOCK_SIZE;
+  }
+  if (size > SIZE_MAX - sizeof(BLOCK) - ARENA_ALIGN) {
+    return false;
+  }
+  BLOCK *block = malloc(sizeof(BLOCK) + ARENA_ALIGN + size);
+  if (!block) {
+    return false;
+  }
+  block->prev = arena->blocks;
+  arena->blocks = block;
+  arena->heap_allocs++;
+  arena->next = (unsigned char *)(block + 1);
+  arena->end = arena->next + ARENA_ALIGN + size;
+  return true;
+}
+
+ARENA *arena_new(void *backing, size_t size) {
+  ARENA *arena;
+  if (backing && size >= sizeof(ARENA) + ARENA_ALIGN) {
+    arena = (ARENA *)align_up(backing);
+    memset(arena, 0, sizeof(ARENA));
+    arena->next = (unsigned char *)(arena + 1);
+    arena->end = (unsigned char *)backing + size;
+    return arena;
+  }
+  arena = malloc(sizeof(ARENA) + ARENA_BLOCK_SIZE);
+  if (!arena) {
+    return NULL;
+  }
+  memset(arena, 0, sizeof(ARENA));
+  arena->next = (unsigned char *)(arena + 1);
+  arena->end = arena->next + ARENA_BLOCK_SIZE;
+  arena->on_heap = true;
+  arena->heap_allocs = 1;
+  return arena;
+}
+
+void *arena_alloc(ARENA *arena, size_t size) {
+  if (!fits(arena, size) && !add_block(arena, size)) {
+    return NULL;
+  }
+  unsigned char *p = align_up(arena->next);
+  arena->next = p + size;
+  return p;
+}
+
+void *arena_calloc(ARENA *arena, size_t size) {
+  void *p = arena_alloc(arena, size);
+  if (p) {
+    memset(p, 0, size);
+  }
+  return p;
+}
+
+size_t arena_heap_allocs(const ARENA *arena) { return arena->heap_allocs; }
+
+void arena_free(ARENA *arena) {
+  if (!arena) {
+    return;
+  }
+  BLOCK *block = arena->blocks;
+  while (block) {
+    BLOCK *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+  if (arena->on_heap) {
+    free(arena);
+  }
+}
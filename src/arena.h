@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Bump allocator.  Allocations are never freed one by one, everything in an
+ * arena is released together by arena_free.  Memory comes from the caller's
+ * backing buffer if one was given, and from malloc'd blocks once that runs
+ * out.
+ */
+typedef struct ARENA ARENA;
+
+/**
+ * Creates an arena inside "backing", which must stay valid until arena_free,
+ * or on the heap if "backing" is NULL or too small to hold the arena itself.
+ * Returns NULL if the arena could not be allocated.
+ */
+ARENA *arena_new(void *backing, size_t size);
+/**
+ * Returns "size" bytes aligned for any type, or NULL if the arena could not
+ * grow.  arena_calloc also zeroes them.
+ */
+void *arena_alloc(ARENA *arena, size_t size);
+void *arena_calloc(ARENA *arena, size_t size);
+/**
+ * Returns how many times the arena has called malloc, for itself or for a
+ * new block.  Allocations carved from a block it already has aren't
+ * counted.
+ */
+size_t arena_heap_allocs(const ARENA *arena);
+/**
+ * Frees every block of the arena and the arena itself.  NULL is ignored.
+ */
+void arena_free(ARENA *arena);
+
+#endif // ARENA_H
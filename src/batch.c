@@ -0,0 +1,304 @@
+#include "batch.h"
+#include "pool.h"
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t cap;
+} PATH_LIST;
+
+typedef struct BATCH BATCH;
+
+typedef struct {
+  BATCH *batch;
+  const char *path;
+} JOB;
+
+/**
+ * Shared state of a batch run.  Each worker owns decoders[worker], and
+ * stats[worker] when stats were asked for.  The totals are guarded by
+ * "lock", which also keeps status lines whole.
+ */
+struct BATCH {
+  PNG_Decoder **decoders;
+  PNG_Stats *stats;
+  pthread_mutex_t lock;
+  size_t ok;
+  size_t failed;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool add_path(PATH_LIST *list, const char *path) {
+  if (list->count == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 256;
+    char **paths = realloc(list->paths, cap * sizeof(char *));
+    if (!paths) {
+      printf("Failed to allocate memory for file list.\n");
+      return false;
+    }
+    list->paths = paths;
+    list->cap = cap;
+  }
+  char *copy = strdup(path);
+  if (!copy) {
+    printf("Failed to allocate memory for file list.\n");
+    return false;
+  }
+  list->paths[list->count++] = copy;
+  return true;
+}
+
+static void free_path_list(PATH_LIST *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+  list->paths = NULL;
+  list->count = 0;
+  list->cap = 0;
+}
+
+/**
+ * Adds every regular file under "dir", skipping hidden entries.
+ */
+static bool collect_dir(PATH_LIST *list, const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "Unable to open directory %s\n", dir);
+    return false;
+  }
+  bool ok = true;
+  struct dirent *entry;
+  while (ok && (entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    size_t len = strlen(dir) + strlen(entry->d_name) + 2;
+    char *path = malloc(len);
+    if (!path) {
+      printf("Failed to allocate memory for file list.\n");
+      ok = false;
+      break;
+    }
+    snprintf(path, len, "%s/%s", dir, entry->d_name);
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        ok = collect_dir(list, path);
+      } else if (S_ISREG(st.st_mode)) {
+        ok = add_path(list, path);
+      }
+    }
+    free(path);
+  }
+  closedir(d);
+  return ok;
+}
+
+/**
+ * Adds one path per line of "f", ignoring blank lines.
+ */
+static bool collect_list(PATH_LIST *list, FILE *f) {
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    size_t len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    if (len == 0) {
+      continue;
+    }
+    if (!add_path(list, line)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool collect_paths(PATH_LIST *list, const char *source) {
+  if (strcmp(source, "-") == 0) {
+    return collect_list(list, stdin);
+  }
+  struct stat st;
+  if (stat(source, &st) != 0) {
+    fprintf(stderr, "Unable to open %s\n", source);
+    return false;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    return collect_dir(list, source);
+  }
+  FILE *f = fopen(source, "r");
+  if (!f) {
+    fprintf(stderr, "Unable to open %s\n", source);
+    return false;
+  }
+  bool ok = collect_list(list, f);
+  fclose(f);
+  return ok;
+}
+
+static void decode_job(void *arg, int worker) {
+  JOB *job = arg;
+  BATCH *batch = job->batch;
+  struct stat st;
+  uint64_t size = stat(job->path, &st) == 0 ? (uint64_t)st.st_size : 0;
+
+  double start = now_seconds();
+  PNG *png = PNG_decoder_decode_path(batch->decoders[worker], job->path);
+  int bad_crcs = png ? PNG_crc_wait(png) : 0;
+  double ms = (now_seconds() - start) * 1000.0;
+
+  pthread_mutex_lock(&batch->lock);
+  batch->bytes_in += size;
+  if (!png) {
+    batch->failed++;
+    printf("FAIL    %9.2f ms  %s\n", ms, job->path);
+  } else if (bad_crcs > 0) {
+    batch->failed++;
+    printf("BADCRC  %9.2f ms  %s (%d chunks)\n", ms, job->path, bad_crcs);
+  } else {
+    batch->ok++;
+    batch->bytes_out += (uint64_t)png->header->width * png->header->height *
+                        (uint64_t)PNG_channels(png);
+    printf("ok      %9.2f ms  %s (%ux%u)\n", ms, job->path,
+           png->header->width, png->header->height);
+  }
+  pthread_mutex_unlock(&batch->lock);
+  free_PNG(png);
+}
+
+static void free_batch(BATCH *batch, int jobs) {
+  if (batch->decoders) {
+    for (int i = 0; i < jobs; i++) {
+      PNG_decoder_free(batch->decoders[i]);
+    }
+    free(batch->decoders);
+    batch->decoders = NULL;
+  }
+  free(batch->stats);
+  batch->stats = NULL;
+  pthread_mutex_destroy(&batch->lock);
+}
+
+static bool init_batch(BATCH *batch, int jobs, const PNG_Options *opts) {
+  memset(batch, 0, sizeof(BATCH));
+  pthread_mutex_init(&batch->lock, NULL);
+  batch->decoders = calloc((size_t)jobs, sizeof(PNG_Decoder *));
+  if (!batch->decoders) {
+    printf("Failed to allocate memory for decoders.\n");
+    return false;
+  }
+  PNG_Options worker_opts = *opts;
+  if (opts->stats) {
+    // per worker, merged into opts->stats at the end
+    batch->stats = calloc((size_t)jobs, sizeof(PNG_Stats));
+    if (!batch->stats) {
+      printf("Failed to allocate memory for stats.\n");
+      return false;
+    }
+  }
+  for (int i = 0; i < jobs; i++) {
+    if (batch->stats) {
+      worker_opts.stats = &batch->stats[i];
+    }
+    batch->decoders[i] = PNG_decoder_new(&worker_opts);
+    if (!batch->decoders[i]) {
+      printf("Failed to allocate memory for decoders.\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Decodes the files in "list" on a pool of "jobs" workers and prints the
+ * totals.  Returns true if every file decoded.
+ */
+static bool decode_all(PATH_LIST *list, int jobs, const PNG_Options *opts) {
+  BATCH batch;
+  if (!init_batch(&batch, jobs, opts)) {
+    free_batch(&batch, jobs);
+    return false;
+  }
+  JOB *job_list = calloc(list->count, sizeof(JOB));
+  if (!job_list) {
+    printf("Failed to allocate memory for batch.\n");
+    free_batch(&batch, jobs);
+    return false;
+  }
+  POOL *pool = pool_new(jobs);
+  if (!pool) {
+    free(job_list);
+    free_batch(&batch, jobs);
+    return false;
+  }
+
+  double start = now_seconds();
+  size_t submitted = 0;
+  for (size_t i = 0; i < list->count; i++) {
+    job_list[i].batch = &batch;
+    job_list[i].path = list->paths[i];
+    if (!pool_submit(pool, decode_job, &job_list[i])) {
+      printf("Failed to queue %s\n", list->paths[i]);
+      break;
+    }
+    submitted++;
+  }
+  pool_wait(pool);
+  double elapsed = now_seconds() - start;
+  if (elapsed <= 0.0) {
+    elapsed = 1e-9;
+  }
+
+  printf("\n%zu files: %zu ok, %zu failed, %.3f s on %d threads\n", submitted,
+         batch.ok, batch.failed, elapsed, pool_num_workers(pool));
+  printf("%.1f files/s, %.1f MB/s read, %.1f MB/s decoded\n",
+         (double)submitted / elapsed, (double)batch.bytes_in / 1e6 / elapsed,
+         (double)batch.bytes_out / 1e6 / elapsed);
+  bool ok = submitted == list->count && batch.failed == 0;
+  if (batch.stats) {
+    for (int i = 0; i < jobs; i++) {
+      PNG_stats_merge(opts->stats, &batch.stats[i]);
+    }
+  }
+
+  pool_free(pool);
+  free(job_list);
+  free_batch(&batch, jobs);
+  return ok;
+}
+
+int run_batch(const char *source, int jobs, const PNG_Options *opts) {
+  PATH_LIST list = {0};
+  if (!collect_paths(&list, source)) {
+    free_path_list(&list);
+    return 1;
+  }
+  if (list.count == 0) {
+    printf("No files found in %s\n", source);
+    free_path_list(&list);
+    return 1;
+  }
+  if (jobs <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = cores > 0 ? (int)cores : 1;
+  }
+  if ((size_t)jobs > list.count) {
+    jobs = (int)list.count;
+  }
+  bool ok = decode_all(&list, jobs, opts);
+  free_path_list(&list);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "png.h"
+
+/**
+ * Decodes every file under "source" without opening a window.  "source" is
+ * either a directory, searched recursively, or a text file listing one path
+ * per line ("-" reads the list from stdin).  Files are decoded concurrently
+ * on "jobs" threads, 0 meaning one per online core.  Prints a status line
+ * per file followed by the aggregate throughput.
+ * Returns 0 if every file decoded, 1 otherwise.
+ */
+int run_batch(const char *source, int jobs, const PNG_Options *opts);
+
+#endif // BATCH_H
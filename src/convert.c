@@ -0,0 +1,172 @@
+#include "convert.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PNGER_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef void (*convert_fn)(uint8_t *out, const uint8_t *in,
+                           size_t num_samples);
+
+static bool has_sse2 = false;
+static bool has_avx2 = false;
+static convert_fn kernel = convert_16_to_8_scalar;
+static CPU_Level kernel_level = CPU_LEVEL_SCALAR;
+
+void convert_16_to_8_scalar(uint8_t *out, const uint8_t *in,
+                            size_t num_samples) {
+  for (size_t i = 0; i < num_samples; i++) {
+    uint16_t sample = (uint16_t)in[i * 2] << 8 | in[(i * 2) + 1];
+    out[i] = sample / 257;
+  }
+}
+
+/*
+ * The SIMD kernels divide by 257 without dividing: for every 16 bit v,
+ * v / 257 == (v - (v >> 8)) >> 8, which only needs shifts and a subtract.
+ * Loaded as little-endian 16 bit lanes the samples have their bytes swapped,
+ * so each lane is swapped back first.  A block of samples is loaded before
+ * its results are stored, and the results take half the room, so converting
+ * in place never overwrites samples that are still to be read.
+ */
+
+#ifdef PNGER_X86
+TARGET_SSE2 static inline __m128i div257_sse2(__m128i lanes) {
+  __m128i v = _mm_or_si128(_mm_slli_epi16(lanes, 8), _mm_srli_epi16(lanes, 8));
+  return _mm_srli_epi16(_mm_sub_epi16(v, _mm_srli_epi16(v, 8)), 8);
+}
+
+TARGET_SSE2 static void convert_sse2(uint8_t *out, const uint8_t *in,
+                                     size_t num_samples) {
+  size_t i = 0;
+  for (; i + 16 <= num_samples; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(in + i * 2));
+    __m128i b = _mm_loadu_si128((const __m128i *)(in + i * 2 + 16));
+    __m128i packed = _mm_packus_epi16(div257_sse2(a), div257_sse2(b));
+    _mm_storeu_si128((__m128i *)(out + i), packed);
+  }
+  convert_16_to_8_scalar(out + i, in + i * 2, num_samples - i);
+}
+
+TARGET_AVX2 static inline __m256i div257_avx2(__m256i lanes) {
+  __m256i v = _mm256_or_si256(_mm256_slli_epi16(lanes, 8),
+                              _mm256_srli_epi16(lanes, 8));
+  return _mm256_srli_epi16(_mm256_sub_epi16(v, _mm256_srli_epi16(v, 8)), 8);
+}
+
+TARGET_AVX2 static void convert_avx2(uint8_t *out, const uint8_t *in,
+                                     size_t num_samples) {
+  size_t i = 0;
+  for (; i + 32 <= num_samples; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(in + i * 2));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(in + i * 2 + 32));
+    // packus works within 128 bit halves, leaving the quarters out of order
+    __m256i packed = _mm256_packus_epi16(div257_avx2(a), div257_avx2(b));
+    packed = _mm256_permute4x64_epi64(packed, 0xD8);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  convert_16_to_8_scalar(out + i, in + i * 2, num_samples - i);
+}
+#endif // PNGER_X86
+
+void convert_16_to_8_sse2(uint8_t *out, const uint8_t *in,
+                          size_t num_samples) {
+#ifdef PNGER_X86
+  if (has_sse2) {
+    convert_sse2(out, in, num_samples);
+    return;
+  }
+#endif
+  convert_16_to_8_scalar(out, in, num_samples);
+}
+
+void convert_16_to_8_avx2(uint8_t *out, const uint8_t *in,
+                          size_t num_samples) {
+#ifdef PNGER_X86
+  if (has_avx2) {
+    convert_avx2(out, in, num_samples);
+    return;
+  }
+#endif
+  convert_16_to_8_scalar(out, in, num_samples);
+}
+
+bool convert_sse2_supported(void) { return has_sse2; }
+
+bool convert_avx2_supported(void) { return has_avx2; }
+
+/**
+ * Picks the kernel once at startup, before main runs.  PNGER_SIMD caps the
+ * instruction set used, as it does for the unfilter kernels.  There is no
+ * ssse3 kernel, so that cap gets the sse2 one.
+ */
+__attribute__((constructor)) static void select_convert_kernel(void) {
+#ifdef PNGER_X86
+  __builtin_cpu_init();
+  has_sse2 = __builtin_cpu_supports("sse2");
+  has_avx2 = __builtin_cpu_supports("avx2");
+  CPU_Level max_level = cpu_level_cap();
+  if (max_level >= CPU_LEVEL_SSE2 && has_sse2) {
+    kernel = convert_sse2;
+    kernel_level = CPU_LEVEL_SSE2;
+  }
+  if (max_level >= CPU_LEVEL_AVX2 && has_avx2) {
+    kernel = convert_avx2;
+    kernel_level = CPU_LEVEL_AVX2;
+  }
+#endif
+}
+
+const char *convert_kernel_level(void) {
+  return cpu_level_name(kernel_level);
+}
+
+#ifdef PNGER_VERIFY_KERNELS
+/**
+ * Returns "size" bytes of scratch space, one buffer per thread, grown as
+ * needed and kept for the life of the thread.  Returns NULL if it couldn't
+ * grow.
+ */
+static uint8_t *verify_scratch(size_t size) {
+  static __thread uint8_t *scratch;
+  static __thread size_t scratch_size;
+  if (size > scratch_size) {
+    uint8_t *grown = realloc(scratch, size);
+    if (!grown) {
+      return NULL;
+    }
+    scratch = grown;
+    scratch_size = size;
+  }
+  return scratch;
+}
+#endif
+
+void convert_16_to_8(uint8_t *out, const uint8_t *in, size_t num_samples) {
+#ifdef PNGER_VERIFY_KERNELS
+  // converting in place overwrites the input, so check against a copy
+  uint8_t *copy = verify_scratch(num_samples * 2);
+  if (copy) {
+    memcpy(copy, in, num_samples * 2);
+  }
+#endif
+  kernel(out, in, num_samples);
+
+#ifdef PNGER_VERIFY_KERNELS
+  if (copy) {
+    convert_16_to_8_scalar(copy, copy, num_samples);
+    if (memcmp(copy, out, num_samples) != 0) {
+      fprintf(stderr,
+              "%s 16 to 8 bit kernel does not match the scalar code.\n",
+              convert_kernel_level());
+      abort();
+    }
+  }
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Takes "num_samples" 16 bit samples, stored big-endian as in the png, and
+ * scales each one down to 8 bits, rounding down as sample / 257 does.
+ * "out" may be the same as "in", but the two must not otherwise overlap.
+ * Uses the fastest kernel the CPU supports.
+ */
+void convert_16_to_8(uint8_t *out, const uint8_t *in, size_t num_samples);
+
+/**
+ * Returns the name of the instruction set convert_16_to_8 dispatches to:
+ * "scalar", "sse2" or "avx2".
+ */
+const char *convert_kernel_level(void);
+
+/**
+ * The individual kernels, exposed for benchmarking and cross-checking.  The
+ * scalar one is the reference the others must match byte for byte.  The
+ * SIMD ones fall back to it on CPUs without the instructions, see
+ * convert_sse2_supported and convert_avx2_supported.
+ */
+void convert_16_to_8_scalar(uint8_t *out, const uint8_t *in,
+                            size_t num_samples);
+void convert_16_to_8_sse2(uint8_t *out, const uint8_t *in,
+                          size_t num_samples);
+void convert_16_to_8_avx2(uint8_t *out, const uint8_t *in,
+                          size_t num_samples);
+bool convert_sse2_supported(void);
+bool convert_avx2_supported(void);
+
+#endif // CONVERT_H
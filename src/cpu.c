@@ -0,0 +1,21 @@
+#include "cpu.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const char *level_names[] = {"scalar", "sse2", "ssse3", "avx2"};
+
+CPU_Level cpu_level_from_name(const char *name) {
+  for (int i = CPU_LEVEL_SCALAR; i <= CPU_LEVEL_AVX2; i++) {
+    if (strcmp(name, level_names[i]) == 0) {
+      return (CPU_Level)i;
+    }
+  }
+  return CPU_LEVEL_AVX2;
+}
+
+const char *cpu_level_name(CPU_Level level) { return level_names[level]; }
+
+CPU_Level cpu_level_cap(void) {
+  const char *cap = getenv("PNGER_SIMD");
+  return cap ? cpu_level_from_name(cap) : CPU_LEVEL_AVX2;
+}
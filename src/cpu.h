@@ -0,0 +1,33 @@
+#ifndef CPU_H
+#define CPU_H
+
+/**
+ * Instruction sets the SIMD kernels are written for, each one implying the
+ * ones before it.  Every set of kernels picks the highest level it has
+ * kernels for that the CPU supports, capped by PNGER_SIMD.
+ */
+typedef enum {
+  CPU_LEVEL_SCALAR,
+  CPU_LEVEL_SSE2,
+  CPU_LEVEL_SSSE3,
+  CPU_LEVEL_AVX2,
+} CPU_Level;
+
+/**
+ * Returns the level named "name" ("scalar", "sse2", "ssse3" or "avx2"), or
+ * CPU_LEVEL_AVX2, meaning no cap, for anything else.
+ */
+CPU_Level cpu_level_from_name(const char *name);
+
+/**
+ * Returns the name of "level", as accepted by cpu_level_from_name.
+ */
+const char *cpu_level_name(CPU_Level level);
+
+/**
+ * Returns the cap set by the PNGER_SIMD environment variable, or
+ * CPU_LEVEL_AVX2 if it isn't set.
+ */
+CPU_Level cpu_level_cap(void);
+
+#endif // CPU_H
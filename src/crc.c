@@ -0,0 +1,230 @@
+#include "crc.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PNGER_X86 1
+#include <immintrin.h>
+#endif
+
+typedef unsigned long (*crc_fn)(unsigned long crc, const unsigned char *buf,
+                                size_t len);
+
+/**
+ * crc_table[0] is the table from the png spec.  crc_table[k][n] is the CRC of
+ * byte n followed by k zero bytes, which lets slicing-by-8 fold eight bytes
+ * per step with independent lookups.
+ */
+static uint32_t crc_table[8][256];
+static bool has_pclmul = false;
+static crc_fn engine = update_crc_slice8;
+static const char *engine_name = "slice8";
+
+/**
+ * Builds the tables and picks the engine once at startup, before main runs.
+ * Setting PNGER_CRC to "slice8", "zlib" or "bytewise" overrides the choice.
+ */
+__attribute__((constructor)) static void make_crc_table(void) {
+  uint32_t c;
+  int n, k;
+  for (n = 0; n < 256; n++) {
+    c = (uint32_t)n;
+    for (k = 0; k < 8; k++) {
+      if (c & 1)
+        c = 0xedb88320L ^ (c >> 1);
+      else
+        c = c >> 1;
+    }
+    crc_table[0][n] = c;
+  }
+  for (n = 0; n < 256; n++) {
+    c = crc_table[0][n];
+    for (k = 1; k < 8; k++) {
+      c = crc_table[0][c & 0xff] ^ (c >> 8);
+      crc_table[k][n] = c;
+    }
+  }
+
+#ifdef PNGER_X86
+  __builtin_cpu_init();
+  has_pclmul =
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+  if (has_pclmul) {
+    engine = update_crc_pclmul;
+    engine_name = "pclmul";
+  }
+
+  const char *choice = getenv("PNGER_CRC");
+  if (!choice) {
+    return;
+  }
+  if (strcmp(choice, "slice8") == 0) {
+    engine = update_crc_slice8;
+    engine_name = "slice8";
+  } else if (strcmp(choice, "zlib") == 0) {
+    engine = update_crc_zlib;
+    engine_name = "zlib";
+  } else if (strcmp(choice, "bytewise") == 0) {
+    engine = update_crc_bytewise;
+    engine_name = "bytewise";
+  }
+}
+
+const char *crc_engine(void) { return engine_name; }
+
+bool crc_pclmul_supported(void) { return has_pclmul; }
+
+unsigned long update_crc_bytewise(unsigned long crc, const unsigned char *buf,
+                                  size_t len) {
+  unsigned long c = crc;
+  size_t n;
+
+  for (n = 0; n < len; n++) {
+    c = crc_table[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
+  }
+  return c;
+}
+
+unsigned long update_crc_slice8(unsigned long crc, const unsigned char *buf,
+                                size_t len) {
+  uint32_t c = (uint32_t)crc;
+  while (len >= 8) {
+    uint32_t one = c ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                        (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+    uint32_t two = (uint32_t)buf[4] | (uint32_t)buf[5] << 8 |
+                   (uint32_t)buf[6] << 16 | (uint32_t)buf[7] << 24;
+    c = crc_table[7][one & 0xff] ^ crc_table[6][(one >> 8) & 0xff] ^
+        crc_table[5][(one >> 16) & 0xff] ^ crc_table[4][one >> 24] ^
+        crc_table[3][two & 0xff] ^ crc_table[2][(two >> 8) & 0xff] ^
+        crc_table[1][(two >> 16) & 0xff] ^ crc_table[0][two >> 24];
+    buf += 8;
+    len -= 8;
+  }
+  return update_crc_bytewise(c, buf, len);
+}
+
+unsigned long update_crc_zlib(unsigned long crc, const unsigned char *buf,
+                              size_t len) {
+  // zlib takes and returns the finished value, not the running register
+  uLong c = (uLong)(crc ^ 0xffffffffL);
+  while (len > 0) {
+    uInt n = len > UINT32_MAX ? UINT32_MAX : (uInt)len;
+    c = crc32(c, buf, n);
+    buf += n;
+    len -= n;
+  }
+  return c ^ 0xffffffffL;
+}
+
+#ifdef PNGER_X86
+/**
+ * Folds 64 bytes at a time with carry-less multiplies, then reduces the
+ * remaining 128 bits to 32 with a Barrett reduction.  Constants are the
+ * bit-reflected k1..k5, P(x) and u from Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction".
+ * "len" must be a multiple of 16 and at least 64.
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+fold_pclmul(uint32_t crc, const unsigned char *buf, size_t len) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  buf += 64;
+  len -= 64;
+
+  // four independent folds of 128 bits each
+  x0 = k1k2;
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    buf += 64;
+    len -= 64;
+  }
+
+  // fold the four lanes into one
+  x0 = k3k4;
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // remaining 16 byte blocks
+  while (len >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)buf));
+    buf += 16;
+    len -= 16;
+  }
+
+  // 128 bits down to 64
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+unsigned long update_crc_pclmul(unsigned long crc, const unsigned char *buf,
+                                size_t len) {
+#ifdef PNGER_X86
+  if (has_pclmul && len >= 64) {
+    size_t folded = len & ~(size_t)15;
+    crc = fold_pclmul((uint32_t)crc, buf, folded);
+    buf += folded;
+    len -= folded;
+  }
+#endif
+  return update_crc_slice8(crc, buf, len);
+}
+
+unsigned long update_crc(unsigned long crc, const unsigned char *buf,
+                         size_t len) {
+  return engine(crc, buf, len);
+}
+
+unsigned long crc(const unsigned char *buf, size_t len) {
+  return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
+}
@@ -0,0 +1,37 @@
+#ifndef CRC_H
+#define CRC_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * CRC-32 as used by png chunks, see
+ * https://www.rfc-editor.org/rfc/rfc2083#page-94
+ * update_crc works on the running register (start from 0xffffffff), crc
+ * returns the finished value that is stored in the file.
+ */
+unsigned long update_crc(unsigned long crc, const unsigned char *buf,
+                         size_t len);
+unsigned long crc(const unsigned char *buf, size_t len);
+
+/**
+ * Returns the name of the engine update_crc dispatches to: "pclmul",
+ * "slice8", "zlib" or "bytewise".
+ */
+const char *crc_engine(void);
+
+/**
+ * The individual engines, exposed for benchmarking and cross-checking.
+ * update_crc_pclmul falls back to slicing-by-8 on CPUs without carry-less
+ * multiply, see crc_pclmul_supported.
+ */
+unsigned long update_crc_bytewise(unsigned long crc, const unsigned char *buf,
+                                  size_t len);
+unsigned long update_crc_slice8(unsigned long crc, const unsigned char *buf,
+                                size_t len);
+unsigned long update_crc_pclmul(unsigned long crc, const unsigned char *buf,
+                                size_t len);
+unsigned long update_crc_zlib(unsigned long crc, const unsigned char *buf,
+                              size_t len);
+bool crc_pclmul_supported(void);
+
+#endif // CRC_H
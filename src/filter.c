@@ -0,0 +1,424 @@
+#include "filter.h"
+#include "cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PNGER_X86 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+/**
+ * Unfilters one scanline that has a prior row.  Kernels are specialised for
+ * a single filter type and bytes per pixel, so neither is passed in.
+ */
+typedef void (*unfilter_fn)(uint8_t *raw, const uint8_t *row,
+                            const uint8_t *prior, size_t len);
+
+// Indexed by [filter type][bytes per pixel], filled in once at startup.
+// NULL entries fall back to unfilter_row_scalar.
+static unfilter_fn kernels[5][9];
+static CPU_Level kernel_level = CPU_LEVEL_SCALAR;
+
+/**
+ * a = left, b = up, c = up left
+ **/
+uint8_t PaethPredictor(uint8_t a, uint8_t b, uint8_t c) {
+  int aa = a;
+  int bb = b;
+  int cc = c;
+  int p = aa + bb - cc;
+  int pa = abs(p - aa);
+  int pb = abs(p - bb);
+  int pc = abs(p - cc);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  if (pb <= pc) {
+    return b;
+  }
+  return c;
+}
+
+/**
+ * Always inlined so the wrappers below get a copy with "bpp" folded to a
+ * constant.
+ */
+static inline __attribute__((always_inline)) bool
+unfilter_scalar(uint8_t *raw, const uint8_t *row, const uint8_t *prior,
+                size_t len, size_t bpp, uint8_t filter_type) {
+  size_t first = bpp < len ? bpp : len;
+  size_t j;
+  switch (filter_type) {
+  case 0: // none-type filter (data just needs to be copied as is)
+    memcpy(raw, row, len);
+    break;
+  case 1: // sub-type filter
+          //(first pixel data is copied as is, then add the raw unfiltered
+          // data from previous pixel to undo the sub filter)
+    memcpy(raw, row, first);
+    for (j = first; j < len; j++) {
+      raw[j] = row[j] + raw[j - bpp];
+    }
+    break;
+  case 2: // above-type filter
+          // (add raw unfiltered data from previous row pixel to undo the
+          // filter, the row above the first one counts as zeros)
+    if (!prior) {
+      memcpy(raw, row, len);
+      break;
+    }
+    for (j = 0; j < len; j++) {
+      raw[j] = row[j] + prior[j];
+    }
+    break;
+  case 3:
+    // raw(x) = average + floor((raw(x-bpp)+prior(x))/2)
+    if (!prior) {
+      // first pixel -> raw(0) = average(0) + floor(0 + 0)
+      memcpy(raw, row, first);
+      for (j = first; j < len; j++) {
+        raw[j] = row[j] + (raw[j - bpp] >> 1);
+      }
+      break;
+    }
+    for (j = 0; j < first; j++) {
+      raw[j] = row[j] + (prior[j] >> 1);
+    }
+    for (j = first; j < len; j++) {
+      uint16_t a = (uint16_t)prior[j];
+      uint16_t b = (uint16_t)raw[j - bpp];
+      raw[j] = row[j] + (uint8_t)((a + b) >> 1);
+    }
+    break;
+  case 4:
+    if (!prior) {
+      // PaethPredictor(a, 0, 0) = a
+      memcpy(raw, row, first);
+      for (j = first; j < len; j++) {
+        raw[j] = row[j] + raw[j - bpp];
+      }
+      break;
+    }
+    for (j = 0; j < first; j++) {
+      // PaethPredictor(0, b, 0) = b
+      raw[j] = row[j] + prior[j];
+    }
+    for (j = first; j < len; j++) {
+      // PaethPredictor(left, up, up-left)
+      raw[j] = row[j] + PaethPredictor(raw[j - bpp], prior[j], prior[j - bpp]);
+    }
+    break;
+  default:
+    fprintf(stderr, "Unsupported filter type for filter method 0.  This "
+                    "message shouldn't appear.\n");
+    return false;
+    break;
+  }
+  return true;
+}
+
+bool unfilter_row_scalar(uint8_t *raw, const uint8_t *row,
+                         const uint8_t *prior, size_t len, size_t bpp,
+                         uint8_t filter_type) {
+  return unfilter_scalar(raw, row, prior, len, bpp, filter_type);
+}
+
+#define SCALAR_KERNEL(name, type, n)                                           \
+  static void name##_scalar_##n(uint8_t *raw, const uint8_t *row,             \
+                                const uint8_t *prior, size_t len) {           \
+    unfilter_scalar(raw, row, prior, len, n, type);                            \
+  }
+#define SCALAR_KERNELS(n)                                                      \
+  SCALAR_KERNEL(sub, 1, n)                                                     \
+  SCALAR_KERNEL(up, 2, n)                                                      \
+  SCALAR_KERNEL(avg, 3, n)                                                     \
+  SCALAR_KERNEL(paeth, 4, n)
+
+SCALAR_KERNELS(1)
+SCALAR_KERNELS(2)
+SCALAR_KERNELS(3)
+SCALAR_KERNELS(4)
+SCALAR_KERNELS(6)
+SCALAR_KERNELS(8)
+
+#ifdef PNGER_X86
+/**
+ * Loads one pixel of "bpp" (at most 8) bytes into the low lanes.
+ * Goes through memcpy so 3 and 6 byte pixels never read past the row.
+ */
+static inline TARGET_SSE2 __m128i load_px(const uint8_t *p, size_t bpp) {
+  uint64_t v = 0;
+  memcpy(&v, p, bpp);
+  return _mm_loadl_epi64((const __m128i *)&v);
+}
+
+static inline TARGET_SSE2 void store_px(uint8_t *p, __m128i x, size_t bpp) {
+  uint64_t v;
+  _mm_storel_epi64((__m128i *)&v, x);
+  memcpy(p, &v, bpp);
+}
+
+static inline TARGET_SSE2 __m128i if_then_else(__m128i c, __m128i t,
+                                               __m128i e) {
+  return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+}
+
+static inline TARGET_SSE2 __m128i abs_sse2(__m128i x) {
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static inline TARGET_SSSE3 __m128i abs_ssse3(__m128i x) {
+  return _mm_abs_epi16(x);
+}
+
+// Sub, Average and Paeth depend on the pixel to the left, so they step one
+// pixel at a time and only the bytes within a pixel run in parallel.
+
+static inline TARGET_SSE2 void sub_sse2(uint8_t *raw, const uint8_t *row,
+                                        size_t len, size_t bpp) {
+  __m128i a = _mm_setzero_si128();
+  for (size_t j = 0; j < len; j += bpp) {
+    a = _mm_add_epi8(a, load_px(row + j, bpp));
+    store_px(raw + j, a, bpp);
+  }
+}
+
+static inline TARGET_SSE2 void avg_sse2(uint8_t *raw, const uint8_t *row,
+                                        const uint8_t *prior, size_t len,
+                                        size_t bpp) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for (size_t j = 0; j < len; j += bpp) {
+    __m128i b = load_px(prior + j, bpp);
+    // _mm_avg_epu8 rounds up, take the carry back off where a + b is odd
+    __m128i avg = _mm_avg_epu8(a, b);
+    avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(avg, load_px(row + j, bpp));
+    store_px(raw + j, a, bpp);
+  }
+}
+
+/**
+ * Paeth in 16 bit lanes, using p - a = b - c, p - b = a - c and
+ * p - c = (b - c) + (a - c).  Ties resolve to a, then b, then c as in
+ * PaethPredictor.  Shared by the SSE2 and SSSE3 kernels, which differ only in
+ * how they take the absolute value.
+ */
+#define PAETH_LOOP(abs16)                                                      \
+  const __m128i zero = _mm_setzero_si128();                                    \
+  __m128i a = zero;                                                            \
+  __m128i c = zero;                                                            \
+  for (size_t j = 0; j < len; j += bpp) {                                      \
+    __m128i b = _mm_unpacklo_epi8(load_px(prior + j, bpp), zero);              \
+    __m128i x = _mm_unpacklo_epi8(load_px(row + j, bpp), zero);                \
+    __m128i pa = _mm_sub_epi16(b, c);                                          \
+    __m128i pb = _mm_sub_epi16(a, c);                                          \
+    __m128i pc = _mm_add_epi16(pa, pb);                                        \
+    pa = abs16(pa);                                                            \
+    pb = abs16(pb);                                                            \
+    pc = abs16(pc);                                                            \
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));               \
+    __m128i nearest =                                                          \
+        if_then_else(_mm_cmpeq_epi16(smallest, pa), a,                         \
+                     if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));       \
+    a = _mm_and_si128(_mm_add_epi16(nearest, x), _mm_set1_epi16(0xff));        \
+    store_px(raw + j, _mm_packus_epi16(a, a), bpp);                            \
+    c = b;                                                                     \
+  }
+
+static inline TARGET_SSE2 void paeth_sse2(uint8_t *raw, const uint8_t *row,
+                                          const uint8_t *prior, size_t len,
+                                          size_t bpp) {
+  PAETH_LOOP(abs_sse2)
+}
+
+static inline TARGET_SSSE3 void paeth_ssse3(uint8_t *raw, const uint8_t *row,
+                                            const uint8_t *prior, size_t len,
+                                            size_t bpp) {
+  PAETH_LOOP(abs_ssse3)
+}
+
+// Up has no dependency along the row, so it runs a full vector at a time.
+
+static TARGET_SSE2 void up_sse2(uint8_t *raw, const uint8_t *row,
+                                const uint8_t *prior, size_t len) {
+  size_t j = 0;
+  for (; j + 16 <= len; j += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(row + j));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prior + j));
+    _mm_storeu_si128((__m128i *)(raw + j), _mm_add_epi8(x, b));
+  }
+  for (; j < len; j++) {
+    raw[j] = row[j] + prior[j];
+  }
+}
+
+static TARGET_AVX2 void up_avx2(uint8_t *raw, const uint8_t *row,
+                                const uint8_t *prior, size_t len) {
+  size_t j = 0;
+  for (; j + 32 <= len; j += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(row + j));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(prior + j));
+    _mm256_storeu_si256((__m256i *)(raw + j), _mm256_add_epi8(x, b));
+  }
+  for (; j < len; j++) {
+    raw[j] = row[j] + prior[j];
+  }
+}
+
+// Rows of 8 bit and 16 bit pixels are always a whole number of pixels long,
+// which the per pixel loops rely on.
+
+#define SSE2_KERNELS(n)                                                        \
+  static TARGET_SSE2 void sub_sse2_##n(uint8_t *raw, const uint8_t *row,      \
+                                       const uint8_t *prior, size_t len) {    \
+    (void)prior;                                                               \
+    sub_sse2(raw, row, len, n);                                                \
+  }                                                                            \
+  static TARGET_SSE2 void avg_sse2_##n(uint8_t *raw, const uint8_t *row,      \
+                                       const uint8_t *prior, size_t len) {    \
+    avg_sse2(raw, row, prior, len, n);                                         \
+  }                                                                            \
+  static TARGET_SSE2 void paeth_sse2_##n(uint8_t *raw, const uint8_t *row,    \
+                                         const uint8_t *prior, size_t len) {  \
+    paeth_sse2(raw, row, prior, len, n);                                       \
+  }                                                                            \
+  static TARGET_SSSE3 void paeth_ssse3_##n(uint8_t *raw, const uint8_t *row,  \
+                                           const uint8_t *prior, size_t len) {\
+    paeth_ssse3(raw, row, prior, len, n);                                      \
+  }
+
+SSE2_KERNELS(3)
+SSE2_KERNELS(4)
+SSE2_KERNELS(6)
+SSE2_KERNELS(8)
+#endif // PNGER_X86
+
+#define SET_KERNELS(level, n)                                                  \
+  kernels[1][n] = sub_##level##_##n;                                           \
+  kernels[3][n] = avg_##level##_##n;                                           \
+  kernels[4][n] = paeth_##level##_##n;
+
+/**
+ * Fills in the kernel table for the best instruction set the CPU supports, up
+ * to "max_level".
+ */
+static void select_kernels(CPU_Level max_level) {
+  static const size_t sizes[] = {1, 2, 3, 4, 6, 8};
+  static const unfilter_fn scalar[][6] = {
+      {sub_scalar_1, sub_scalar_2, sub_scalar_3, sub_scalar_4, sub_scalar_6,
+       sub_scalar_8},
+      {up_scalar_1, up_scalar_2, up_scalar_3, up_scalar_4, up_scalar_6,
+       up_scalar_8},
+      {avg_scalar_1, avg_scalar_2, avg_scalar_3, avg_scalar_4, avg_scalar_6,
+       avg_scalar_8},
+      {paeth_scalar_1, paeth_scalar_2, paeth_scalar_3, paeth_scalar_4,
+       paeth_scalar_6, paeth_scalar_8},
+  };
+  for (int f = 1; f <= 4; f++) {
+    for (int i = 0; i < 6; i++) {
+      kernels[f][sizes[i]] = scalar[f - 1][i];
+    }
+  }
+  kernel_level = CPU_LEVEL_SCALAR;
+
+#ifdef PNGER_X86
+  __builtin_cpu_init();
+  if (max_level >= CPU_LEVEL_SSE2 && __builtin_cpu_supports("sse2")) {
+    kernel_level = CPU_LEVEL_SSE2;
+    for (size_t n = 1; n <= 8; n++) {
+      kernels[2][n] = kernels[2][n] ? up_sse2 : NULL;
+    }
+    SET_KERNELS(sse2, 3)
+    SET_KERNELS(sse2, 4)
+    SET_KERNELS(sse2, 6)
+    SET_KERNELS(sse2, 8)
+  }
+  if (max_level >= CPU_LEVEL_SSSE3 && __builtin_cpu_supports("ssse3")) {
+    kernel_level = CPU_LEVEL_SSSE3;
+    kernels[4][3] = paeth_ssse3_3;
+    kernels[4][4] = paeth_ssse3_4;
+    kernels[4][6] = paeth_ssse3_6;
+    kernels[4][8] = paeth_ssse3_8;
+  }
+  if (max_level >= CPU_LEVEL_AVX2 && __builtin_cpu_supports("avx2")) {
+    kernel_level = CPU_LEVEL_AVX2;
+    for (size_t n = 1; n <= 8; n++) {
+      kernels[2][n] = kernels[2][n] ? up_avx2 : NULL;
+    }
+  }
+#else
+  (void)max_level;
+#endif
+}
+
+/**
+ * Picks the kernels once at startup, before main runs, so unfilter_row never
+ * has to check whether they are set up.
+ * Setting PNGER_SIMD to "scalar", "sse2" or "ssse3" caps the instruction set
+ * used, which is handy for comparing kernels.
+ */
+__attribute__((constructor)) static void select_unfilter_kernels(void) {
+  select_kernels(cpu_level_cap());
+}
+
+const char *unfilter_set_kernel_level(const char *max_level) {
+  select_kernels(cpu_level_from_name(max_level));
+  return cpu_level_name(kernel_level);
+}
+
+const char *unfilter_kernel_level(void) {
+  return cpu_level_name(kernel_level);
+}
+
+#ifdef PNGER_VERIFY_KERNELS
+/**
+ * Returns a row of at least "len" bytes for the scalar result, one per
+ * thread, grown as needed and kept for the life of the thread so checking
+ * doesn't add an allocation per row.  Returns NULL if it couldn't grow.
+ */
+static uint8_t *verify_scratch(size_t len) {
+  static __thread uint8_t *scratch;
+  static __thread size_t scratch_size;
+  if (len > scratch_size) {
+    uint8_t *grown = realloc(scratch, len);
+    if (!grown) {
+      return NULL;
+    }
+    scratch = grown;
+    scratch_size = len;
+  }
+  return scratch;
+}
+#endif
+
+bool unfilter_row(uint8_t *raw, const uint8_t *row, const uint8_t *prior,
+                  size_t len, size_t bpp, uint8_t filter_type) {
+  // The kernels all assume a prior row.  The first row of an image is
+  // cheap enough to leave to the scalar code.
+  if (!prior || filter_type == 0 || filter_type > 4 || bpp > 8 ||
+      !kernels[filter_type][bpp]) {
+    return unfilter_row_scalar(raw, row, prior, len, bpp, filter_type);
+  }
+  kernels[filter_type][bpp](raw, row, prior, len);
+
+#ifdef PNGER_VERIFY_KERNELS
+  uint8_t *check = verify_scratch(len);
+  if (check) {
+    unfilter_row_scalar(check, row, prior, len, bpp, filter_type);
+    if (memcmp(check, raw, len) != 0) {
+      fprintf(stderr,
+              "%s unfilter kernel for filter %d, bpp %zu does not match the "
+              "scalar code.\n",
+              unfilter_kernel_level(), filter_type, bpp);
+      abort();
+    }
+  }
+#endif
+  return true;
+}
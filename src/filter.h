@@ -0,0 +1,43 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t PaethPredictor(uint8_t a, uint8_t b, uint8_t c);
+
+/**
+ * Undoes the filter of one scanline.
+ * "row" is the filtered scanline without its filter type byte and "len" bytes
+ * long.  "prior" is the previous unfiltered scanline, or NULL for the first
+ * scanline of the image.  The result is written to "raw", which must not
+ * overlap "row".  "bpp" is the number of bytes per complete pixel, rounded up
+ * to 1.
+ * Uses the fastest kernel the CPU supports for the filter type and bpp.
+ */
+bool unfilter_row(uint8_t *raw, const uint8_t *row, const uint8_t *prior,
+                  size_t len, size_t bpp, uint8_t filter_type);
+
+/**
+ * Plain C version of unfilter_row, the reference the SIMD kernels must match
+ * byte for byte.
+ */
+bool unfilter_row_scalar(uint8_t *raw, const uint8_t *row,
+                         const uint8_t *prior, size_t len, size_t bpp,
+                         uint8_t filter_type);
+
+/**
+ * Returns the name of the instruction set the unfilter kernels were selected
+ * for: "scalar", "sse2", "ssse3" or "avx2".
+ */
+const char *unfilter_kernel_level(void);
+
+/**
+ * Reselects the kernels as if PNGER_SIMD were set to "max_level", for
+ * cross-checking each instruction set against the scalar code.  Returns the
+ * level actually selected, which is lower when the CPU lacks the
+ * instructions.  Not safe while other threads are unfiltering.
+ */
+const char *unfilter_set_kernel_level(const char *max_level);
+
+#endif // FILTER_H
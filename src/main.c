@@ -1,5 +1,9 @@
 #include "main.h"
+#include "batch.h"
+#include "output.h"
 #include "png.h"
+#include "tiles.h"
+#include "upload.h"
 
 float verticies[] = {
     // positions   // tex coords
@@ -19,33 +23,80 @@ static const char *vertex_shader_text =
     "layout (location = 0) in vec2 aPos;\n"
     "layout (location = 1) in vec2 aTexCoord;\n"
     "out vec2 TexCoord;\n"
+    "uniform vec4 rect;\n" // left, bottom, right, top of the quad
     "void main()\n"
     "{\n"
-    "    gl_Position = vec4(aPos.xy, 0.0, 1.0);\n"
+    "    gl_Position = vec4(mix(rect.xy, rect.zw, aPos * 0.5 + 0.5), 0.0, "
+    "1.0);\n"
     "    TexCoord = aTexCoord;\n"
     "}\n";
 
+/**
+ * One fragment shader for every kind of texture, picked out by defines put
+ * in front of it: GAMMA to gamma correct, PALETTE for palette indices,
+ * looked up in "palette", and PACKED for rows of "bits" bit samples packed
+ * into the bytes of an integer texture, unpacked going by the size of the
+ * tile in pixels.
+ */
 static const char *fragment_shader_text =
-    "#version 330 core\n"
     "in vec2 TexCoord;\n"
     "out vec4 FragColor;\n"
+    "#ifdef PACKED\n"
+    "uniform usampler2D tex;\n"
+    "uniform int bits;\n"
+    "uniform vec2 size;\n"
+    "#else\n"
     "uniform sampler2D tex;\n"
+    "#endif\n"
+    "#ifdef PALETTE\n"
+    "uniform sampler2D palette;\n"
+    "#endif\n"
     "void main()\n"
     "{\n"
-    "    vec4 color = texture(tex, vec2(TexCoord.x, 1.0 - TexCoord.y));\n"
+    "    vec2 pos = vec2(TexCoord.x, 1.0 - TexCoord.y);\n"
+    "#ifdef PACKED\n"
+    "    ivec2 pixel = min(ivec2(pos * size), ivec2(size) - 1);\n"
+    "    int per_byte = 8 / bits;\n"
+    "    ivec2 texel = ivec2(pixel.x / per_byte, pixel.y);\n"
+    "    uint stored = texelFetch(tex, texel, 0).r;\n"
+    "    int shift = 8 - bits * (pixel.x % per_byte + 1);\n"
+    "    uint mask = (1u << uint(bits)) - 1u;\n"
+    "    uint value = (stored >> uint(shift)) & mask;\n"
+    "#ifdef PALETTE\n"
+    "    vec4 color = vec4(texelFetch(palette, ivec2(value, 0), 0).rgb, 1.0);\n"
+    "#else\n"
+    "    vec4 color = vec4(vec3(float(value) / float(mask)), 1.0);\n"
+    "#endif\n"
+    "#elif defined(PALETTE)\n"
+    "    float index = texture(tex, pos).r;\n"
+    "    ivec2 entry = ivec2(int(index * 255.0 + 0.5), 0);\n"
+    "    vec4 color = vec4(texelFetch(palette, entry, 0).rgb, 1.0);\n"
+    "#else\n"
+    "    vec4 color = texture(tex, pos);\n"
+    "#endif\n"
+    "#ifdef GAMMA\n"
     "    color.rgb = pow(color.rgb, vec3(1.0 / 2.2));\n"
+    "#endif\n"
     "    FragColor = color;\n"
     "}\n";
 
-static const char *fragment_shader_text_no_gama =
-    "#version 330 core\n"
-    "in vec2 TexCoord;\n"
-    "out vec4 FragColor;\n"
-    "uniform sampler2D tex;\n"
-    "void main()\n"
-    "{\n"
-    "    FragColor = texture(tex, vec2(TexCoord.x, 1.0 - TexCoord.y));\n"
-    "}\n";
+// windows for larger images are scaled down to fit in this
+#define MAX_WINDOW_WIDTH 1920
+#define MAX_WINDOW_HEIGHT 1080
+
+/**
+ * State of the window, reached through its user pointer.  "view" is moved
+ * by dragging with the left button held down and zoomed by scrolling.
+ * Nothing is drawn unless "redraw" is set, by whatever changed what the
+ * window should show.
+ */
+typedef struct {
+  VIEW view;
+  bool dragging;
+  bool redraw;
+  double last_x;
+  double last_y;
+} VIEWER;
 
 static void error_callback(int error, const char *description) {
   fprintf(stderr, "Error: %s\n", description);
@@ -57,48 +108,253 @@ static void key_callback(GLFWwindow *window, int key, int scancode, int action,
     glfwSetWindowShouldClose(window, GLFW_TRUE);
 }
 
+/**
+ * Zooms by "yoffset" steps of the scroll wheel, keeping the point of the
+ * image under the cursor where it is.
+ */
+static void scroll_callback(GLFWwindow *window, double xoffset,
+                            double yoffset) {
+  VIEWER *viewer = glfwGetWindowUserPointer(window);
+  VIEW *view = &viewer->view;
+  int width, height;
+  double x, y;
+  glfwGetWindowSize(window, &width, &height);
+  glfwGetCursorPos(window, &x, &y);
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+  // cursor offset from the center in fractions of the window
+  double dx = x / width - 0.5;
+  double dy = y / height - 0.5;
+  double zoom = view->zoom * pow(1.25, yoffset);
+  if (zoom < 1.0) {
+    zoom = 1.0;
+  }
+  view->cx += dx / view->zoom - dx / zoom;
+  view->cy += dy / view->zoom - dy / zoom;
+  view->zoom = zoom;
+  viewer->redraw = true;
+}
+
+static void mouse_button_callback(GLFWwindow *window, int button, int action,
+                                  int mods) {
+  VIEWER *viewer = glfwGetWindowUserPointer(window);
+  if (button == GLFW_MOUSE_BUTTON_LEFT) {
+    viewer->dragging = action == GLFW_PRESS;
+    glfwGetCursorPos(window, &viewer->last_x, &viewer->last_y);
+  }
+}
+
+static void cursor_pos_callback(GLFWwindow *window, double x, double y) {
+  VIEWER *viewer = glfwGetWindowUserPointer(window);
+  int width, height;
+  glfwGetWindowSize(window, &width, &height);
+  if (viewer->dragging && width > 0 && height > 0) {
+    VIEW *view = &viewer->view;
+    view->cx -= (x - viewer->last_x) / width / view->zoom;
+    view->cy -= (y - viewer->last_y) / height / view->zoom;
+    viewer->redraw = true;
+  }
+  viewer->last_x = x;
+  viewer->last_y = y;
+}
+
+static void framebuffer_size_callback(GLFWwindow *window, int width,
+                                     int height) {
+  VIEWER *viewer = glfwGetWindowUserPointer(window);
+  viewer->redraw = true;
+}
+
+static void window_refresh_callback(GLFWwindow *window) {
+  VIEWER *viewer = glfwGetWindowUserPointer(window);
+  viewer->redraw = true;
+}
+
+/**
+ * Scales "*width" by "*height" down to fit the largest window we open,
+ * keeping the aspect ratio.
+ */
+static void fit_window(int *width, int *height) {
+  double scale = 1.0;
+  if (*width > MAX_WINDOW_WIDTH) {
+    scale = (double)MAX_WINDOW_WIDTH / *width;
+  }
+  if (*height * scale > MAX_WINDOW_HEIGHT) {
+    scale = (double)MAX_WINDOW_HEIGHT / *height;
+  }
+  *width = (int)(*width * scale) > 0 ? (int)(*width * scale) : 1;
+  *height = (int)(*height * scale) > 0 ? (int)(*height * scale) : 1;
+}
+
+static void print_usage(void) {
+  printf("Usage: pnger [options] <file.png>\n");
+  printf("       pnger [options] --batch <dir|list>\n");
+  printf("Options:\n");
+  printf("  --crc=<mode>  Chunk CRC checking: all (default), skip-idat,\n");
+  printf("                critical or deferred (checked in the background,\n");
+  printf("                mismatches reported after the first frame).\n");
+  printf("  --batch <src> Decode every file in a directory, or listed one\n");
+  printf("                per line in a file (- for stdin), headless.\n");
+  printf("  --jobs=<n>    Number of batch decode threads, default one per\n");
+  printf("                core.\n");
+  printf("  --out <file>  Write the decoded image to a PPM/PAM file (- for\n");
+  printf("                stdout) instead of opening a window.\n");
+  printf("  --raw         Write raw RGB/RGBA bytes instead, to stdout\n");
+  printf("                unless --out is given.\n");
+  printf("  --cpu-expand  Have the decoder turn every image into 8 bit\n");
+  printf("                RGB(A) rather than leaving palette lookups,\n");
+  printf("                gray to RGB and the unpacking of 1, 2 and 4\n");
+  printf("                bit samples to the GPU and uploading 16 bit\n");
+  printf("                samples as they are.\n");
+  printf("  --stats[=json]\n");
+  printf("                Print time, bytes and allocations per decode\n");
+  printf("                stage to stderr, as a table or as JSON.  The\n");
+  printf("                viewer also prints the frames it drew on exit.\n");
+}
+
+static bool parse_crc_mode(const char *arg, PNG_CrcMode *mode) {
+  if (strcmp(arg, "all") == 0) {
+    *mode = PNG_CRC_ALL;
+  } else if (strcmp(arg, "skip-idat") == 0) {
+    *mode = PNG_CRC_SKIP_IDAT;
+  } else if (strcmp(arg, "critical") == 0) {
+    *mode = PNG_CRC_CRITICAL;
+  } else if (strcmp(arg, "deferred") == 0) {
+    *mode = PNG_CRC_DEFERRED;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("Requires one argument.  Should be a png file.\n");
-    return 1;
+  const char *path = NULL;
+  const char *batch = NULL;
+  int jobs = 0;
+  const char *out = NULL;
+  bool raw = false;
+  bool cpu_expand = false;
+  bool show_stats = false;
+  bool stats_json = false;
+  PNG_Stats stats;
+  PNG_stats_reset(&stats);
+  PNG_Options opts;
+  PNG_default_options(&opts);
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--crc=", 6) == 0) {
+      if (!parse_crc_mode(argv[i] + 6, &opts.crc_mode)) {
+        printf("Unknown CRC mode: %s\n", argv[i] + 6);
+        print_usage();
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      if (i + 1 >= argc) {
+        printf("--batch needs a directory or list file.\n");
+        print_usage();
+        return 1;
+      }
+      batch = argv[++i];
+    } else if (strcmp(argv[i], "--out") == 0) {
+      if (i + 1 >= argc) {
+        printf("--out needs a file name.\n");
+        print_usage();
+        return 1;
+      }
+      out = argv[++i];
+    } else if (strcmp(argv[i], "--raw") == 0) {
+      raw = true;
+    } else if (strcmp(argv[i], "--cpu-expand") == 0) {
+      cpu_expand = true;
+    } else if (strcmp(argv[i], "--stats") == 0 ||
+               strcmp(argv[i], "--stats=text") == 0) {
+      show_stats = true;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      show_stats = true;
+      stats_json = true;
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      jobs = atoi(argv[i] + 7);
+      if (jobs <= 0) {
+        printf("Invalid number of jobs: %s\n", argv[i] + 7);
+        print_usage();
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      printf("Unknown option: %s\n", argv[i]);
+      print_usage();
+      return 1;
+    } else if (path) {
+      printf("Should only be one file.\n");
+      return 1;
+    } else {
+      path = argv[i];
+    }
   }
-  if (argc > 2) {
-    printf("Should only be one argument.\n");
-    return 1;
+  if (raw && !out) {
+    out = "-";
   }
-  FILE *f = fopen(argv[1], "rb");
-  if (!f) {
-    perror("fopen");
-    return 1;
+  if (show_stats) {
+    opts.stats = &stats;
   }
-  PNG *png = decode_PNG(f);
-  fclose(f);
-  if (!png) {
-    fprintf(stderr, "Unable to decode png.\n");
+  if (batch) {
+    if (path) {
+      printf("Can't open a file and run a batch at the same time.\n");
+      return 1;
+    }
+    if (out) {
+      printf("--out and --raw can't be used with --batch.\n");
+      return 1;
+    }
+    int status = run_batch(batch, jobs, &opts);
+    if (show_stats) {
+      fflush(stdout);
+      PNG_stats_print(&stats, stderr, stats_json);
+    }
+    return status;
+  }
+  if (!path) {
+    printf("Requires one argument.  Should be a png file.\n");
+    print_usage();
     return 1;
   }
 
-  int width = (int)png->header->width;
-  int height = (int)png->header->height;
+  if (out) {
+    // headless, nothing below touches GLFW
+    PNG *png = decode_PNG_path_opts(path, &opts);
+    if (!png) {
+      fprintf(stderr, "Unable to decode png.\n");
+      return 1;
+    }
+    bool ok = write_pixels(png, out, raw ? OUTPUT_RAW : OUTPUT_PNM);
+    int bad = PNG_crc_wait(png);
+    if (bad > 0) {
+      fprintf(stderr, "WARNING: %d chunk(s) failed CRC verification.\n", bad);
+      ok = false;
+    }
+    if (show_stats) {
+      PNG_stats_print(&stats, stderr, stats_json);
+    }
+    free_PNG(png);
+    return ok ? 0 : 1;
+  }
 
   glfwSetErrorCallback(error_callback);
 
   if (!glfwInit()) {
     fprintf(stderr, "Unable to initialize openGL.\n");
-    free_PNG(png);
     exit(EXIT_FAILURE);
   }
 
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  // the context is needed before the decode so rows can go straight to the
+  // texture, the window is sized and shown once the image is in
+  glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-  GLFWwindow *window =
-      glfwCreateWindow(width, height, "PNGER v0.03", NULL, NULL);
+  GLFWwindow *window = glfwCreateWindow(640, 480, "PNGER v0.03", NULL, NULL);
   if (!window) {
     fprintf(stderr, "Unable to create window.\n");
     glfwTerminate();
-    free_PNG(png);
     exit(EXIT_FAILURE);
   }
 
@@ -108,6 +364,44 @@ int main(int argc, char **argv) {
   gladLoadGL(glfwGetProcAddress);
   glfwSwapInterval(1);
 
+  if (!cpu_expand) {
+    opts.keep |=
+        PNG_KEEP_INDICES | PNG_KEEP_PACKED | PNG_KEEP_GRAY | PNG_KEEP_16;
+  }
+  UPLOAD up;
+  upload_init(&up, &opts, opts.stats);
+  GLuint tex = up.tex;
+  glBindTexture(GL_TEXTURE_2D, tex);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  PNG *png = decode_PNG_path_opts(path, &opts);
+  upload_free(&up);
+  if (!png) {
+    fprintf(stderr, "Unable to decode png.\n");
+    glDeleteTextures(1, &tex);
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    return 1;
+  }
+
+  int width = (int)png->header->width;
+  int height = (int)png->header->height;
+  fit_window(&width, &height);
+  glfwSetWindowSize(window, width, height);
+  glfwShowWindow(window);
+
+  VIEWER viewer = {{1.0, 0.5, 0.5}, false, true, 0.0, 0.0};
+  glfwSetWindowUserPointer(window, &viewer);
+  glfwSetScrollCallback(window, scroll_callback);
+  glfwSetMouseButtonCallback(window, mouse_button_callback);
+  glfwSetCursorPosCallback(window, cursor_pos_callback);
+  glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+  glfwSetWindowRefreshCallback(window, window_refresh_callback);
+
   GLuint vertex_buffer;
   glGenBuffers(1, &vertex_buffer);
   glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
@@ -130,11 +424,21 @@ int main(int argc, char **argv) {
 
   const GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
 
-  if (png->header->pixel_format == PALETTE || png->header->has_gama == false || png->header->gamma == 45455) {
-    glShaderSource(fragment_shader, 1, &fragment_shader_text_no_gama, NULL);
-  } else {
-    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
+  bool indexed = png->header->pixel_format == PALETTE && PNG_channels(png) == 1;
+  bool packed = PNG_depth(png) < 8;
+  char defines[128] = "#version 330 core\n";
+  if (indexed) {
+    strcat(defines, "#define PALETTE\n");
+  }
+  if (packed) {
+    strcat(defines, "#define PACKED\n");
+  }
+  if (png->header->pixel_format != PALETTE && png->header->has_gama &&
+      png->header->gamma != 45455) {
+    strcat(defines, "#define GAMMA\n");
   }
+  const char *fragment_sources[] = {defines, fragment_shader_text};
+  glShaderSource(fragment_shader, 2, fragment_sources, NULL);
 
   glCompileShader(fragment_shader);
   glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &compiled);
@@ -175,6 +479,26 @@ int main(int argc, char **argv) {
   } else {
     fprintf(stderr, "Could not find 'tex' uniform!\n");
   }
+  GLint rect_loc = glGetUniformLocation(program, "rect");
+  GLint size_loc = glGetUniformLocation(program, "size");
+  if (packed) {
+    glUniform1i(glGetUniformLocation(program, "bits"), PNG_depth(png));
+  }
+
+  GLuint palette_tex = 0;
+  if (indexed) {
+    // 256 entries whatever "num_pal" is, the unused ones are black
+    glUniform1i(glGetUniformLocation(program, "palette"), 1);
+    glGenTextures(1, &palette_tex);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, palette_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 256, 1, 0, GL_RGB,
+                 GL_UNSIGNED_BYTE, png->header->pal);
+    glActiveTexture(GL_TEXTURE0);
+  }
 
   GLuint vao;
   glGenVertexArrays(1, &vao);
@@ -195,47 +519,20 @@ int main(int argc, char **argv) {
   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices,
                GL_STATIC_DRAW);
 
-  GLuint tex;
-  glGenTextures(1, &tex);
-  glBindTexture(GL_TEXTURE_2D, tex);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-  switch (png->header->pixel_format) {
-  case RGBA:
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, png->pixels);
-    break;
-  case RGB:
-  case PALETTE:
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB,
-                 GL_UNSIGNED_BYTE, png->pixels);
-    break;
-  case GSA:
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, png->pixels);
-    break;
-  case GS:
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB,
-                 GL_UNSIGNED_BYTE, png->pixels);
-    break;
-  default:
-    fprintf(stderr,
-            "Texture generation not yet implemented for color mode %d.\n",
-            png->header->color_type);
+  TILES tiles;
+  bool have_tiles;
+  if (up.streamed) {
+    have_tiles = tiles_init_texture(&tiles, png, tex);
+  } else {
+    // too large for one texture, or the upload couldn't be streamed
+    glDeleteTextures(1, &tex);
+    have_tiles = tiles_init(&tiles, png, opts.stats);
+  }
+  if (!have_tiles) {
     glfwDestroyWindow(window);
     glfwTerminate();
     free_PNG(png);
     exit(EXIT_FAILURE);
-    break;
-  }
-
-  GLenum err = glGetError();
-  if (err != GL_NO_ERROR) {
-    printf("GL Error after glTexImage2D: 0x%x\n", err);
   }
 
   if (png->header->pixel_format == RGBA || png->header->pixel_format == GSA) {
@@ -246,8 +543,20 @@ int main(int argc, char **argv) {
 
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
   GLint fb = 0;
+  bool crc_reported = false;
+  uint64_t frames = 0;
+  uint64_t frame_ns = 0;
+  uint64_t loop_start = PNG_stats_clock();
 
+  // the image only changes when something happens, so wait for events and
+  // draw only when one of them asked for it
   while (!glfwWindowShouldClose(window)) {
+    if (!viewer.redraw) {
+      glfwWaitEvents();
+      continue;
+    }
+    viewer.redraw = false;
+    uint64_t frame_start = PNG_stats_clock();
     glfwGetFramebufferSize(window, &width, &height);
 
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -256,13 +565,38 @@ int main(int argc, char **argv) {
     glUseProgram(program);
     glBindVertexArray(vao);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    tiles_draw(&tiles, &viewer.view, rect_loc, size_loc);
 
     glfwSwapBuffers(window);
-    glfwPollEvents();
+    frame_ns += PNG_stats_clock() - frame_start;
+    frames++;
+
+    if (!crc_reported) {
+      if (show_stats) {
+        // tiles in view have been uploaded by now
+        PNG_stats_print(&stats, stderr, stats_json);
+      }
+      // a deferred CRC check is only looked at once the image is up
+      int bad = PNG_crc_wait(png);
+      if (bad > 0) {
+        fprintf(stderr, "WARNING: %d chunk(s) failed CRC verification.\n",
+                bad);
+      }
+      crc_reported = true;
+    }
   }
 
+  if (show_stats) {
+    double seconds = (double)(PNG_stats_clock() - loop_start) / 1e9;
+    fprintf(stderr, "%llu frames in %.2f s open, %.3f ms per frame\n",
+            (unsigned long long)frames, seconds,
+            frames ? (double)frame_ns / 1e6 / (double)frames : 0.0);
+  }
+
+  tiles_free(&tiles);
+  if (palette_tex) {
+    glDeleteTextures(1, &palette_tex);
+  }
   glfwDestroyWindow(window);
 
   glfwTerminate();
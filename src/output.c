@@ -0,0 +1,43 @@
+#include "output.h"
+#include <errno.h>
+#include <string.h>
+
+static bool write_header(const PNG *png, FILE *f) {
+  uint32_t width = png->header->width;
+  uint32_t height = png->header->height;
+  if (PNG_channels(png) == 3) {
+    return fprintf(f, "P6\n%u %u\n255\n", width, height) > 0;
+  }
+  return fprintf(f,
+                 "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+                 "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+                 width, height) > 0;
+}
+
+bool write_pixels(const PNG *png, const char *path, OutputFormat format) {
+  bool to_stdout = strcmp(path, "-") == 0;
+  FILE *f = to_stdout ? stdout : fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  size_t size = (size_t)png->header->width * png->header->height *
+                (size_t)PNG_channels(png);
+  bool ok = true;
+  if (format == OUTPUT_PNM) {
+    ok = write_header(png, f);
+  }
+  if (ok && size > 0) {
+    ok = fwrite(png->pixels, 1, size, f) == size;
+  }
+  if (to_stdout) {
+    ok = fflush(f) == 0 && ok;
+  } else {
+    ok = fclose(f) == 0 && ok;
+  }
+  if (!ok) {
+    fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+  }
+  return ok;
+}
@@ -0,0 +1,17 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include "png.h"
+
+typedef enum {
+  OUTPUT_PNM, // PPM (P6) without alpha, PAM (P7) with alpha
+  OUTPUT_RAW, // the pixel buffer as is, see PNG_channels
+} OutputFormat;
+
+/**
+ * Writes the decoded pixels of "png" to "path", or to stdout if "path" is
+ * "-".  Rows are written top to bottom, 8 bits per sample.
+ * Returns false and prints why on failure.
+ */
+bool write_pixels(const PNG *png, const char *path, OutputFormat format);
+
+#endif // OUTPUT_H
@@ -1,19 +1,51 @@
 #include "png.h"
+#include "arena.h"
+#include "convert.h"
+#include "crc.h"
+#include "filter.h"
+#include "stats.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #define MAX_DATA_LEN 2147483647
 #define IHDR_LEN 13
 #define PROPERTY_BIT 0b100000
 
+/**
+ * Chunk types are handled as the four type bytes read as a big-endian
+ * uint32_t, so they can be compared and switched on directly.
+ */
+#define FOURCC(a, b, c, d)                                                     \
+  ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 |           \
+   (uint32_t)(d))
+
+enum {
+  CHUNK_IHDR = FOURCC('I', 'H', 'D', 'R'),
+  CHUNK_PLTE = FOURCC('P', 'L', 'T', 'E'),
+  CHUNK_IDAT = FOURCC('I', 'D', 'A', 'T'),
+  CHUNK_IEND = FOURCC('I', 'E', 'N', 'D'),
+  CHUNK_gAMA = FOURCC('g', 'A', 'M', 'A'),
+  CHUNK_pHYs = FOURCC('p', 'H', 'Y', 's'),
+};
+
+// the ancillary bit of the first type byte
+#define ANCILLARY_BIT ((uint32_t)PROPERTY_BIT << 24)
+
 const unsigned char PNG_SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
-unsigned long crc_table[256];
-int crc_table_computed = 0;
-bool idat_start = false;
-bool idat_end = false;
 
 /**
  * Struct with two fields for proper validation of a png chunk length.
@@ -28,93 +60,93 @@ typedef struct {
   bool valid;
 } LENGTH;
 
+/**
+ * Field "type" is the FOURCC of the chunk type, 0 if the chunk could not be
+ * read.
+ * Field "data" points into the source, which only keeps it until the next
+ * chunk is read, or into the decode's arena.  It is never freed on its own.
+ */
 typedef struct {
-  char *type;
+  uint32_t type;
   uint32_t length;
   void *data;
   bool ancillary;
 } CHUNK;
 
-uint8_t PaethPredictor(uint8_t a, uint8_t b, uint8_t c);
-void get_pass_dimensions(uint32_t *height, uint32_t *width, PNG_IHDR *hdr,
-                         uint32_t start_x, uint32_t start_y, uint32_t step_x,
-                         uint32_t step_y);
-size_t get_pass_buf_size(PNG_IHDR *hdr, uint32_t start_x, uint32_t start_y,
-                         uint32_t step_x, uint32_t step_y);
-
-void free_IHDR(PNG_IHDR *hdr) {
-  if (!hdr) {
-    return;
-  }
-  free(hdr);
-}
+/**
+ * Where the bytes of a png come from.
+ * If "map" is set the whole file is mapped read-only and chunks are handed out
+ * as views into the mapping, otherwise they are read from "fp" with fread
+ * into "buf".  That buffer belongs to the decoder and is kept from one file
+ * to the next, growing whenever a chunk doesn't fit.
+ * Field "pos" is the read offset into the mapping.  Field "arena" is the
+ * current decode's arena, where the chunks that outlive the read go.
+ */
+typedef struct {
+  FILE *fp;
+  const unsigned char *map;
+  size_t map_size;
+  size_t pos;
+  ARENA *arena;
+  unsigned char *buf;
+  size_t buf_size;
+} SOURCE;
 
-void make_crc_table(void) {
-  unsigned long c;
-  int n, k;
-  for (n = 0; n < 256; n++) {
-    c = (unsigned long)n;
-    for (k = 0; k < 8; k++) {
-      if (c & 1)
-        c = 0xedb88320L ^ (c >> 1);
-      else
-        c = c >> 1;
-    }
-    crc_table[n] = c;
-  }
-  crc_table_computed = 1;
-  // printf("CRC table computed\n");
-}
+size_t get_bytes_per_pixel(PNG_IHDR *hdr);
 
-unsigned long update_crc(unsigned long crc, unsigned char *buf, int len) {
-  unsigned long c = crc;
-  int n;
+void invalid_png();
 
-  if (!crc_table_computed)
-    make_crc_table();
-  for (n = 0; n < len; n++) {
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+/**
+ * Copies the next "num" bytes of the source into "buf".
+ * Returns false if the source does not have that many bytes left.
+ */
+bool read_source(SOURCE *src, void *buf, size_t num) {
+  if (!src->map) {
+    return fread(buf, num, 1, src->fp) == 1;
   }
-  return c;
-}
-
-unsigned long crc(unsigned char *buf, int len) {
-  return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
+  if (num > src->map_size - src->pos) {
+    return false;
+  }
+  memcpy(buf, src->map + src->pos, num);
+  src->pos += num;
+  return true;
 }
 
-void invalid_png();
 /**
- * Accepts a FILE pointer.
- * Checks the signature of the FILE,
+ * Accepts a SOURCE pointer.
+ * Checks the signature of the source,
  * to see if it is valid for png.
- * **THIS MOVES THE INTERNAL READ/WRITE POINTER FOR THE FILE.**
+ * **THIS MOVES THE READ POINTER OF THE SOURCE.**
  * Returns 1 if the file has a valid png signature, 0 otherwise.
  */
-int get_sig(FILE *fp) {
+int get_sig(SOURCE *src) {
   unsigned char sig[8];
-  if (fread(sig, 1, 8, fp) != 8)
+  if (!read_source(src, sig, 8))
     return 0;
 
   return memcmp(sig, PNG_SIGNATURE, 8) == 0;
 }
 
 /**
- * Accepts a FILE pointer.
+ * Accepts a SOURCE pointer.
  * Returns the size in bytes of the file,
  * without affecting internal FILE struct pointers.
  */
-long get_file_size(FILE *fp) {
+long get_file_size(SOURCE *src) {
   long size;
 
-  fseek(fp, 0L, SEEK_END);
-  size = ftell(fp);
-  rewind(fp);
+  if (src->map) {
+    return (long)src->map_size;
+  }
+  fseek(src->fp, 0L, SEEK_END);
+  size = ftell(src->fp);
+  rewind(src->fp);
 
   return size;
 }
 
 /**
- * Accepts a FILE pointer that is ready
+ * Accepts a SOURCE pointer that is ready
  * to have its png chunk length checked,
  * typically after the signature has been
  * validated or after an entire chunk has been
@@ -123,9 +155,9 @@ long get_file_size(FILE *fp) {
  * process can fail, check the LENGTH.valid bool
  * to be certain of validity.
  */
-LENGTH get_chunk_length(FILE *fp) {
+LENGTH get_chunk_length(SOURCE *src) {
   LENGTH len;
-  if (fread(&len.len, 4, 1, fp) != 1) {
+  if (!read_source(src, &len.len, 4)) {
     len.valid = false;
     return len;
   }
@@ -141,14 +173,21 @@ LENGTH get_chunk_length(FILE *fp) {
   return len;
 }
 
-char *get_chunk_type(unsigned char **buf) {
-  char *t = (char *)calloc(5, 1);
-  if (!t) {
-    return NULL;
+/**
+ * Reads the chunk type at "*buf" as a FOURCC and moves past it.
+ * Returns 0 unless all four bytes are ASCII letters, as the spec requires.
+ */
+uint32_t get_chunk_type(const unsigned char **buf) {
+  uint32_t type = 0;
+  for (int i = 0; i < 4; i++) {
+    unsigned char c = (*buf)[i];
+    if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))) {
+      return 0;
+    }
+    type = type << 8 | c;
   }
-  memcpy(t, *buf, 4);
   *buf = *buf + 4;
-  return t;
+  return type;
 }
 
 void bad_header(PNG_IHDR *hdr) {
@@ -157,32 +196,59 @@ void bad_header(PNG_IHDR *hdr) {
   return;
 }
 
-void invalid_crc(void) { printf("CRC failed.\n"); }
+void invalid_crc(void) { fprintf(stderr, "CRC failed.\n"); }
 
-bool get_chunk_bytes(void *buf, size_t num, FILE *fp) {
-  if (fread(buf, num, 1, fp) != 1) {
+/**
+ * Returns a pointer to the next "num" bytes of the source, or NULL on failure.
+ * For a mapped source this is a view into the mapping.  Otherwise the bytes
+ * are read into the source's buffer and stay there until the next call.
+ */
+const unsigned char *get_chunk_bytes(SOURCE *src, size_t num,
+                                     PNG_Stats *stats) {
+  if (src->map) {
+    if (num > src->map_size - src->pos) {
+      invalid_png();
+      return NULL;
+    }
+    const unsigned char *view = src->map + src->pos;
+    src->pos += num;
+    return view;
+  }
+  if (num > src->buf_size) {
+    size_t size = src->buf_size * 2 > num ? src->buf_size * 2 : num;
+    unsigned char *buf = realloc(src->buf, size);
+    if (!buf) {
+      fprintf(stderr, "Error allocating memory\n");
+      return NULL;
+    }
+    stats_alloc(stats, PNG_STAGE_PARSE, 1);
+    src->buf = buf;
+    src->buf_size = size;
+  }
+  if (fread(src->buf, num, 1, src->fp) != 1) {
     invalid_png();
-    return false;
+    return NULL;
   }
-  return true;
+  return src->buf;
 }
 
-void get_buffer(unsigned char **buf, void *field, int len) {
+void get_buffer(const unsigned char **buf, void *field, int len) {
   memcpy(field, *buf, len);
   *buf = *buf + len;
 }
 
-bool get_crc(unsigned long *crc, FILE *fp) {
-  if (fread(crc, 4, 1, fp) != 1) {
+bool get_crc(unsigned long *crc, SOURCE *src) {
+  uint32_t c;
+  if (!read_source(src, &c, 4)) {
     invalid_png();
     return false;
   }
-  *crc = ntohl(*crc);
-  // printf("inside get_crc: %lu\n", *crc);
+  *crc = ntohl(c);
+  // fprintf(stderr, "inside get_crc: %lu\n", *crc);
   return true;
 }
 
-void get_IHDR(unsigned char **buf, PNG_IHDR *hdr) {
+void get_IHDR(const unsigned char **buf, PNG_IHDR *hdr) {
   get_buffer(buf, &hdr->width, 4);
   hdr->width = ntohl(hdr->width);
   get_buffer(buf, &hdr->height, 4);
@@ -194,8 +260,38 @@ void get_IHDR(unsigned char **buf, PNG_IHDR *hdr) {
   get_buffer(buf, &hdr->interlace_method, 1);
 }
 
-CHUNK get_chunk(FILE *fp) {
-  LENGTH len = get_chunk_length(fp);
+/**
+ * Allocates "size" bytes from "arena" for "stage", counting it in "stats"
+ * only if the arena had to go to the heap for it.
+ */
+void *stage_alloc(ARENA *arena, size_t size, PNG_Stats *stats,
+                  PNG_Stage stage) {
+  size_t heap_allocs = arena_heap_allocs(arena);
+  void *p = arena_alloc(arena, size);
+  stats_alloc(stats, stage, arena_heap_allocs(arena) - heap_allocs);
+  return p;
+}
+
+/**
+ * Decides from the chunk type whether the CRC should be checked now.
+ */
+bool should_check_crc(PNG_CrcMode mode, uint32_t type) {
+  bool idat = type == CHUNK_IDAT;
+  switch (mode) {
+  case PNG_CRC_SKIP_IDAT:
+    return !idat;
+  case PNG_CRC_CRITICAL:
+    return !idat && (type & ANCILLARY_BIT) == 0;
+  case PNG_CRC_DEFERRED:
+    return false;
+  case PNG_CRC_ALL:
+  default:
+    return true;
+  }
+}
+
+CHUNK read_chunk(SOURCE *src, PNG_CrcMode crc_mode, PNG_Stats *stats) {
+  LENGTH len = get_chunk_length(src);
   CHUNK chunk = {0};
   if (!len.valid) {
     invalid_png();
@@ -203,162 +299,134 @@ CHUNK get_chunk(FILE *fp) {
   }
   chunk.length = len.len;
 
-  unsigned char *original = calloc((size_t)(len.len + 4), 1);
-  unsigned char *buf = original;
-  if (!get_chunk_bytes(buf, len.len + 4, fp)) {
+  const unsigned char *buf = get_chunk_bytes(src, (size_t)len.len + 4, stats);
+  if (!buf) {
     invalid_png();
-    free(original);
-    buf = NULL;
-    original = NULL;
     chunk.length = 0;
     return chunk;
   }
 
-  unsigned long crc_computed = crc(buf, (int)(len.len + 4));
   unsigned long ccrc;
   unsigned long *ccrc_ptr = &ccrc;
-  if (!get_crc(ccrc_ptr, fp)) {
+  if (!get_crc(ccrc_ptr, src)) {
     invalid_png();
-    free(original);
     buf = NULL;
-    original = NULL;
     ccrc_ptr = NULL;
     chunk.length = 0;
     return chunk;
   }
-  if (crc_computed != ccrc) {
+  // the CRC covers the type too, so read it without moving past it
+  const unsigned char *type_bytes = buf;
+  uint32_t type = get_chunk_type(&type_bytes);
+  if (!type) {
+    fprintf(stderr, "Invalid chunk type.\n");
+    invalid_png();
+    chunk.length = 0;
+    return chunk;
+  }
+  bool crc_ok = true;
+  if (should_check_crc(crc_mode, type)) {
+    uint64_t crc_start = stats_start(stats);
+    crc_ok = crc(buf, (size_t)len.len + 4) == ccrc;
+    stats_stop(stats, PNG_STAGE_CRC, crc_start, (uint64_t)len.len + 4);
+  }
+  if (!crc_ok) {
     invalid_crc();
-    free(original);
     buf = NULL;
-    original = NULL;
     ccrc_ptr = NULL;
     chunk.length = 0;
     return chunk;
   }
   ccrc_ptr = NULL;
 
-  // printf("buf before get_chunk_type: %p\n", buf);
-  chunk.type = get_chunk_type(&buf);
-  if (!chunk.type || strlen(chunk.type) != 4) {
-    invalid_png();
-    free(original);
-    buf = NULL;
-    original = NULL;
-    chunk.length = 0;
-    return chunk;
+  chunk.type = type;
+  buf = type_bytes;
+  if ((type & ANCILLARY_BIT) != 0) {
+    chunk.ancillary = true;
   }
-  if (strcmp(chunk.type, "gAMA") == 0) {
-    uint32_t *gama = calloc(1, sizeof(uint32_t));
+
+  switch (type) {
+  case CHUNK_gAMA: {
+    if (chunk.length != 4) {
+      fprintf(stderr, "ERROR: Invalid gAMA chunk length.\n");
+      chunk.type = 0;
+      chunk.length = 0;
+      return chunk;
+    }
+    uint32_t *gama =
+        stage_alloc(src->arena, sizeof(uint32_t), stats, PNG_STAGE_PARSE);
     if (!gama) {
-      free(original);
-      buf = NULL;
-      original = NULL;
+      chunk.type = 0;
       return chunk;
     }
     memcpy(gama, buf, sizeof(uint32_t));
     *gama = ntohl(*gama);
     chunk.data = gama;
-    free(original);
-    original = NULL;
-    buf = NULL;
-    return chunk;
-  }
-
-  if ((chunk.type[0] & PROPERTY_BIT) == PROPERTY_BIT) {
-    chunk.ancillary = true;
-  }
-  if (chunk.ancillary == true) {
-    free(original);
-    buf = NULL;
-    original = NULL;
     return chunk;
   }
 
-  if (strcmp(chunk.type, "IHDR") == 0) {
-    PNG_IHDR *hdr = (PNG_IHDR *)calloc(1, sizeof(PNG_IHDR));
+  case CHUNK_IHDR: {
+    if (chunk.length != IHDR_LEN) {
+      // caught by the caller, which wants exactly one IHDR up front
+      return chunk;
+    }
+    PNG_IHDR *hdr =
+        stage_alloc(src->arena, sizeof(PNG_IHDR), stats, PNG_STAGE_PARSE);
     if (!hdr) {
-      printf("Error allocating memory\n");
-      free(original);
-      buf = NULL;
-      original = NULL;
+      fprintf(stderr, "Error allocating memory\n");
+      chunk.type = 0;
       chunk.length = 0;
       return chunk;
     }
+    memset(hdr, 0, sizeof(PNG_IHDR));
     get_IHDR(&buf, hdr);
-
     chunk.data = hdr;
-    free(original);
-    original = NULL;
-    buf = NULL;
     return chunk;
   }
 
-  if (strcmp(chunk.type, "PLTE") == 0 && chunk.length % 3 != 0 &&
-      chunk.length != 0) {
-    printf("ERROR: Invalid PLTE chunk length.\n");
-    free(original);
-    buf = NULL;
-    original = NULL;
-    chunk.length = 0;
-    return chunk;
-  }
-  if (strcmp(chunk.type, "PLTE") == 0) {
-    int num_plte = chunk.length / 3;
-    PLTE *plte = (PLTE *)calloc((size_t)num_plte, sizeof(PLTE));
-    if (!plte) {
-      printf("Error allocating memory\n");
-      free(original);
-      buf = NULL;
-      original = NULL;
+  case CHUNK_PLTE:
+    if (chunk.length % 3 != 0) {
+      fprintf(stderr, "ERROR: Invalid PLTE chunk length.\n");
+      chunk.type = 0;
       chunk.length = 0;
       return chunk;
     }
-    memcpy(plte, buf, (size_t)chunk.length);
-    chunk.data = plte;
-    free(original);
-    original = NULL;
-    buf = NULL;
+    // the entries are copied into the header straight away
+    // fall through
+  case CHUNK_IDAT:
+    // used where it is, before the next chunk is read
+    chunk.data = (void *)buf;
     return chunk;
-  }
 
-  if (strcmp(chunk.type, "IDAT") == 0) {
-    // printf("IDAT chunk length %d\n", chunk.length);
-    unsigned char *data = (unsigned char *)calloc((size_t)chunk.length, 1);
-    if (!data) {
-      printf("Error allocating memory\n");
-      free(original);
-      buf = NULL;
-      original = NULL;
-      chunk.length = 0;
-      return chunk;
+  case CHUNK_IEND:
+    if (chunk.length != 0) {
+      fprintf(stderr, "IEND chunk length nonzero! Bad PNG.\n");
     }
-    memcpy(data, buf, (size_t)chunk.length);
-    chunk.data = data;
-    free(original);
-    original = NULL;
-    buf = NULL;
     return chunk;
-  }
 
-  if (strcmp(chunk.type, "IEND") == 0) {
-    chunk.data = NULL;
-    if (chunk.length != 0) {
-      printf("IEND chunk length nonzero! Bad PNG.\n");
+  default:
+    // ancillary chunks other than gAMA are skipped, as are unknown ones
+    if (!chunk.ancillary) {
+      chunk.length = 0;
     }
-    free(original);
-    original = NULL;
-    buf = NULL;
     return chunk;
   }
+}
 
-  free(original);
-  original = NULL;
-  buf = NULL;
-  chunk.length = 0;
+/**
+ * Reads the next chunk, see read_chunk.  Time spent checking the CRC is
+ * charged to PNG_STAGE_CRC and the rest to PNG_STAGE_PARSE.
+ */
+CHUNK get_chunk(SOURCE *src, PNG_CrcMode crc_mode, PNG_Stats *stats) {
+  uint64_t start = stats_start(stats);
+  uint64_t crc_ns = stats_ns(stats, PNG_STAGE_CRC);
+  CHUNK chunk = read_chunk(src, crc_mode, stats);
+  stats_stop_outer(stats, PNG_STAGE_PARSE, start, (uint64_t)chunk.length + 12,
+                   stats_ns(stats, PNG_STAGE_CRC) - crc_ns);
   return chunk;
 }
 
-void invalid_png() { printf("File is not a valid png!\n"); }
+void invalid_png() { fprintf(stderr, "File is not a valid png!\n"); }
 
 void print_IHDR(PNG_IHDR *hdr) {
   printf("Header contents:\n");
@@ -394,56 +462,32 @@ void print_IHDR(PNG_IHDR *hdr) {
   printf("----------------\n");
 }
 
-void free_chunk_data(CHUNK *ch) {
-  if (ch == NULL) {
-    return;
-  }
-  if (ch->data != NULL) {
-    free(ch->data);
-    ch->data = NULL;
-  }
-}
-
-void free_chunks_data(CHUNK *ch, int num) {
-  if (ch == NULL) {
-    return;
-  }
-  for (int i = 0; i < num; i++) {
-    free_chunk_data(&ch[i]);
-  }
-}
-
-void free_chunks(CHUNK *ch, int num) {
-  free_chunks_data(ch, num);
-  free(ch);
-}
-
 void print_chunk(CHUNK *ch) {
   if (!ch) {
     printf("Null chunk\n");
     return;
   }
-  printf("Chunk Type: %s\n", ch->type);
+  printf("Chunk Type: %c%c%c%c\n", (char)(ch->type >> 24),
+         (char)(ch->type >> 16), (char)(ch->type >> 8), (char)ch->type);
   printf("Chunk Length: %d\n", ch->length);
   printf("Ancillary: %s\n", ch->ancillary ? "true" : "false");
   printf("----------------\n");
-  if (strcmp(ch->type, "IHDR") == 0) {
+  switch (ch->type) {
+  case CHUNK_IHDR: {
     PNG_IHDR *hdr = ch->data;
     print_IHDR(hdr);
     return;
   }
-  if (strcmp(ch->type, "pHYs") == 0) {
+  case CHUNK_pHYs:
     return;
-  }
-  if (strcmp(ch->type, "IDAT") == 0) {
+  case CHUNK_IDAT: {
     unsigned char *data = ch->data;
     printf("Compression method/flags code: %x\n", data[0]);
     printf("Additional flags/check bits: %x\n", data[1]);
     printf("----------------\n");
     return;
   }
-
-  if (strcmp(ch->type, "IEND") == 0) {
+  case CHUNK_IEND:
     return;
   }
 
@@ -452,19 +496,19 @@ void print_chunk(CHUNK *ch) {
 
 bool verify_IHDR_data(PNG_IHDR *hdr) {
   if (hdr->width == 0 || hdr->height == 0) {
-    printf("Invalid resolution.\n");
+    fprintf(stderr, "Invalid resolution.\n");
     return false;
   }
   if (hdr->compression_method != 0) {
-    printf("Unknown compression method.\n");
+    fprintf(stderr, "Unknown compression method.\n");
     return false;
   }
   if (hdr->filter_method != 0) {
-    printf("Unknown filter method.\n");
+    fprintf(stderr, "Unknown filter method.\n");
     return false;
   }
   if (hdr->interlace_method > 1) {
-    printf("Unknown interlace method.\n");
+    fprintf(stderr, "Unknown interlace method.\n");
     return false;
   }
   return true;
@@ -536,388 +580,552 @@ size_t get_buffer_size(uint32_t height, uint32_t width, uint8_t bit_depth,
   }
 
   buffer_size = height * *bytes_per_row;
-  // printf("buffer_size within get_buffer_size: %zu\n", buffer_size);
+  // fprintf(stderr, "buffer_size within get_buffer_size: %zu\n", buffer_size);
   return buffer_size;
 }
 
-void test_uncompress(void) {
-  // zlib compressed "hello\n"
-  unsigned char sample_data[] = {0x78, 0x9c, 0xcb, 0x48, 0xcd, 0xc9, 0xc9,
-                                 0x57, 0x28, 0xcf, 0x2f, 0xca, 0x49, 0x01,
-                                 0x00, 0x1a, 0x0b, 0x04, 0x5d};
-  unsigned long sample_size = sizeof(sample_data);
-  unsigned char buffer[64];
-  uLongf buf_len = sizeof(buffer);
-
-  int r = uncompress(buffer, &buf_len, sample_data, sample_size);
-  printf("Return value: %d\n", r);
-}
-
-int decompress_pixels(const unsigned char *compressed_data,
-                      size_t compressed_size, PNG_IHDR *hdr, uint8_t **out_data,
-                      size_t *out_size, size_t *bytes_per_row) {
-  if (!compressed_data || !hdr || !out_data || !out_size || !bytes_per_row) {
-    printf("Null pointer passed to decompress pixels.\n");
-    return -1;
-  }
-  size_t buffer_size = 0;
-  if (hdr->interlace_method == 0) {
-    buffer_size = get_buffer_size(hdr->height, hdr->width, hdr->bit_depth,
-                                  hdr->pixel_format, bytes_per_row);
-  } else if (hdr->interlace_method == 1) {
-    // TODO:
-    printf("Decompress interlace.\n");
-    buffer_size = get_pass_buf_size(hdr, 0, 0, 8, 8);
-    buffer_size += get_pass_buf_size(hdr, 4, 0, 8, 8);
-    buffer_size += get_pass_buf_size(hdr, 0, 4, 4, 8);
-    buffer_size += get_pass_buf_size(hdr, 2, 0, 4, 4);
-    buffer_size += get_pass_buf_size(hdr, 0, 2, 2, 4);
-    buffer_size += get_pass_buf_size(hdr, 1, 0, 2, 2);
-    buffer_size += get_pass_buf_size(hdr, 0, 1, 1, 2);
-  } else {
-    printf("Unknown interlace method detected.\n");
-    return -1;
-  }
-  *out_data = malloc(buffer_size);
-  if (!*out_data) {
-    fprintf(stderr, "malloc failed for buffer size %zu\n", buffer_size);
-    return -1;
+static inline uint8_t replicate_bits(uint8_t val, int bit_depth) {
+  switch (bit_depth) {
+  case 1:
+    return val ? 0xFF : 0x00;
+  case 2:
+    return (val << 6) | (val << 4) | (val << 2) | val;
+  case 4:
+    return (val << 4) | val;
+  default:
+    return val;
   }
+}
 
-  int z_result =
-      uncompress(*out_data, &buffer_size, compressed_data, compressed_size);
-  if (z_result != Z_OK) {
-    fprintf(stderr, "uncompress result: %d\n", z_result);
-    fflush(stderr);
-    free(*out_data);
-    *out_data = NULL;
-    return z_result;
-  }
-  *out_size = buffer_size;
-  return Z_OK;
+/**
+ * Returns sample "x" of a row of 1, 2, 4 or 8 bit samples.  Samples below 8
+ * bits are packed from the most significant bit down.
+ */
+static inline uint8_t get_sample(const uint8_t *row, uint32_t x,
+                                 int bit_depth) {
+  if (bit_depth == 8) {
+    return row[x];
+  }
+  uint32_t per_byte = 8 / bit_depth;
+  int shift = 8 - bit_depth * (int)(x % per_byte + 1);
+  return (row[x / per_byte] >> shift) & ((1 << bit_depth) - 1);
 }
 
 /**
- * a = left, b = up, c = up left
- **/
-uint8_t PaethPredictor(uint8_t a, uint8_t b, uint8_t c) {
-  int aa = a;
-  int bb = b;
-  int cc = c;
-  int p = aa + bb - cc;
-  int pa = abs(p - aa);
-  int pb = abs(p - bb);
-  int pc = abs(p - cc);
-  if (pa <= pb && pa <= pc) {
-    return a;
-  }
-  if (pb <= pc) {
-    return b;
-  }
-  return c;
-}
-
-/** This takes in the raw unfiltered data with bit depth 16
- * and applies an srgb approximation to it before downsampling
- * to 8 bit
+ * Sets the channels per pixel and bits per channel the rows of "hdr" are
+ * written out with, given the PNG_Keep flags "keep".
  */
-uint8_t *convert_16_to_8(uint8_t *data, size_t num_bytes, PixelFormat format) {
-  bool is_alpha = false;
-  size_t alpha = 0;
-  if (format == RGBA || format == GSA) {
-    is_alpha = true;
+static void output_layout(const PNG_IHDR *hdr, unsigned keep, int *channels,
+                          int *depth) {
+  bool packed = keep & PNG_KEEP_PACKED && hdr->bit_depth < 8;
+  *depth = keep & PNG_KEEP_16 && hdr->bit_depth == 16 ? 16 : 8;
+  switch (hdr->pixel_format) {
+  case RGBA:
+    *channels = 4;
+    break;
+  case GSA:
+    *channels = keep & PNG_KEEP_GRAY ? 2 : 4;
+    break;
+  case PALETTE:
+    *channels = keep & PNG_KEEP_INDICES ? 1 : 3;
+    if (*channels == 1 && packed) {
+      *depth = hdr->bit_depth;
+    }
+    break;
+  case GS:
+    *channels = packed || keep & PNG_KEEP_GRAY ? 1 : 3;
+    if (packed) {
+      *depth = hdr->bit_depth;
+    }
+    break;
+  default:
+    *channels = 3;
+    break;
   }
-  if (format == RGBA) {
-    alpha = 4;
-  } else if (format == GSA) {
-    alpha = 2;
+}
+
+/**
+ * Turns one unfiltered row into 8 bit RGB, or RGBA for formats with alpha, in
+ * "out".  16 bit rows must have been converted to 8 bits already.  Sub-byte
+ * gray samples are scaled up to the full range and palette indices looked up
+ * in hdr->pal, or left as they are with PNG_KEEP_INDICES in "keep".  With
+ * PNG_KEEP_GRAY gray isn't repeated in RGB.
+ */
+void expand_row(const PNG_IHDR *hdr, unsigned keep, const uint8_t *raw,
+                uint8_t *out) {
+  uint32_t width = hdr->width;
+  int bit_depth = hdr->bit_depth == 16 ? 8 : hdr->bit_depth;
+  switch (hdr->pixel_format) {
+  case RGB:
+    memcpy(out, raw, (size_t)width * 3);
+    break;
+  case RGBA:
+    memcpy(out, raw, (size_t)width * 4);
+    break;
+  case GSA:
+    if (keep & PNG_KEEP_GRAY) {
+      memcpy(out, raw, (size_t)width * 2);
+      break;
+    }
+    for (uint32_t x = 0; x < width; x++) {
+      out[x * 4] = raw[x * 2];
+      out[x * 4 + 1] = raw[x * 2];
+      out[x * 4 + 2] = raw[x * 2];
+      out[x * 4 + 3] = raw[x * 2 + 1];
+    }
+    break;
+  case GS:
+    if (keep & PNG_KEEP_GRAY) {
+      for (uint32_t x = 0; x < width; x++) {
+        out[x] = replicate_bits(get_sample(raw, x, bit_depth), bit_depth);
+      }
+      break;
+    }
+    for (uint32_t x = 0; x < width; x++) {
+      uint8_t px = replicate_bits(get_sample(raw, x, bit_depth), bit_depth);
+      out[x * 3] = px;
+      out[x * 3 + 1] = px;
+      out[x * 3 + 2] = px;
+    }
+    break;
+  case PALETTE:
+    if (keep & PNG_KEEP_INDICES) {
+      for (uint32_t x = 0; x < width; x++) {
+        out[x] = get_sample(raw, x, bit_depth);
+      }
+      break;
+    }
+    for (uint32_t x = 0; x < width; x++) {
+      const PLTE *entry = &hdr->pal[get_sample(raw, x, bit_depth)];
+      out[x * 3] = entry->r;
+      out[x * 3 + 1] = entry->g;
+      out[x * 3 + 2] = entry->b;
+    }
+    break;
+  default:
+    break;
   }
+}
 
-  uint8_t *new_data = malloc(num_bytes / 2);
-  // maps color to allow for good 16 bit approximation
-  for (size_t i = 0; i < num_bytes / 2; i++) {
-    uint16_t sample = (uint16_t)data[i * 2] << 8 | data[(i * 2) + 1];
-    new_data[i] = sample / 257;
+/**
+ * Same as expand_row for 16 bit rows kept at 16 bits, where only gray has
+ * anything to do: each two byte gray sample is repeated in RGB.
+ */
+void expand_row_16(const PNG_IHDR *hdr, const uint8_t *raw, uint8_t *out) {
+  uint32_t width = hdr->width;
+  if (hdr->pixel_format == GSA) {
+    for (uint32_t x = 0; x < width; x++) {
+      for (int c = 0; c < 3; c++) {
+        memcpy(out + x * 8 + c * 2, raw + x * 4, 2);
+      }
+      memcpy(out + x * 8 + 6, raw + x * 4 + 2, 2);
+    }
+  } else if (hdr->pixel_format == GS) {
+    for (uint32_t x = 0; x < width; x++) {
+      for (int c = 0; c < 3; c++) {
+        memcpy(out + x * 6 + c * 2, raw + x * 2, 2);
+      }
+    }
   }
-  free(data);
-  return new_data;
 }
 
-static inline float srgb_encode(float linear) {
-  if (linear <= 0.0031308f)
-    return 12.92f * linear;
-  else
-    return 1.055f * powf(linear, 1.0f / 2.4f) - 0.055f;
+/**
+ * Inflate state carried across IDAT chunks, so each chunk can be inflated as
+ * soon as it is parsed instead of gathering the whole zlib stream first.
+ * Inflate only ever fills "scanline", one filtered row with its filter type
+ * byte.  As soon as a row is complete it is unfiltered and written out with
+ * the layout of "png", "row_size" bytes each, RGB(A) unless the PNG_Keep
+ * flags in "keep" say otherwise.  Rows "band_start" up to "band_end" go to
+ * "pixels", "stride" bytes apart.  Once those run out "output", the
+ * caller's output function, is asked for room for the next ones.
+ * When "as_is" is set the rows need no conversion, just copying out.  When
+ * "direct" is set as well they aren't copied either, but unfiltered
+ * straight into "pixels", using the row above as the prior row.  Otherwise
+ * they are unfiltered into alternate halves of "row_buf" and converted from
+ * there, the last third of it holding 16 bit rows scaled down to 8 bits.
+ * Field "started" is set once the first IDAT has been seen and "finished"
+ * once zlib reports the end of the stream.  Field "stats" is where inflate
+ * and unfilter times go, NULL if nobody asked for them.
+ * The inflater lives as long as its decoder: "strm", once "strm_ready", is
+ * reset rather than set up again for the next image, and "scanline" and
+ * "row_buf" only grow, to "scanline_size" and "row_buf_size" bytes.
+ */
+typedef struct {
+  z_stream strm;
+  bool strm_ready;
+  uint8_t *scanline;
+  size_t scanline_size;
+  uint8_t *row_buf;
+  size_t row_buf_size;
+  const PNG_IHDR *hdr;
+  PNG_OutputFn output;
+  void *output_user;
+  unsigned keep;
+  const PNG *png;
+  size_t row_size;
+  uint8_t *pixels;
+  size_t stride;
+  uint32_t band_start;
+  uint32_t band_end;
+  bool as_is;
+  bool direct;
+  size_t bytes_per_row;
+  size_t bpp;
+  uint32_t rows;
+  uint32_t height;
+  bool started;
+  bool finished;
+  PNG_Stats *stats;
+} INFLATER;
+
+/**
+ * Abandons the image being inflated, keeping the stream and buffers for the
+ * next one.
+ */
+void free_inflater(INFLATER *inf) {
+  inf->pixels = NULL;
+  inf->started = false;
 }
 
-void apply_srgb(uint8_t *pixels, size_t size, PixelFormat format) {
-  bool is_alpha = format == RGBA || format == GSA;
-  size_t alpha_stride = (format == RGBA) ? 4 : (format == GSA) ? 2 : 0;
-  for (int i = 0; i < 16; i++) {
-    printf("%02X ", pixels[i]);
-  }
-  puts("");
+/**
+ * Releases the stream and buffers, when the decoder is done with.
+ */
+void end_inflater(INFLATER *inf) {
+  if (inf->strm_ready) {
+    inflateEnd(&inf->strm);
+    inf->strm_ready = false;
+  }
+  free(inf->scanline);
+  free(inf->row_buf);
+  inf->scanline = NULL;
+  inf->scanline_size = 0;
+  inf->row_buf = NULL;
+  inf->row_buf_size = 0;
+  inf->pixels = NULL;
+  inf->started = false;
+}
 
-  for (size_t i = 0; i < size; i++) {
-    if (is_alpha && i % alpha_stride == alpha_stride - 1) {
-      continue;
-    }
-    float linear = pixels[i] / 255.0f;
-    float encoded = srgb_encode(linear);
-    pixels[i] = (uint8_t)roundf(encoded * 255.0f);
-  }
+static voidpf counting_zalloc(voidpf opaque, uInt items, uInt size) {
+  INFLATER *inf = opaque;
+  stats_alloc(inf->stats, PNG_STAGE_INFLATE, 1);
+  return malloc((size_t)items * size);
 }
 
-static inline uint8_t replicate_bits(uint8_t val, int bit_depth) {
-  switch (bit_depth) {
-  case 1:
-    return val ? 0xFF : 0x00;
-  case 2:
-    return (val << 6) | (val << 4) | (val << 2) | val;
-  case 4:
-    return (val << 4) | val;
-  default:
-    return val;
-  }
+static void counting_zfree(voidpf opaque, voidpf address) {
+  (void)opaque;
+  free(address);
 }
 
-bool upscale_to_8(uint8_t *data, PNG_IHDR *hdr, uint8_t **pixels) {
-  if (!data || !hdr || !pixels) {
-    printf("Null pointer passed to upscale_to_8.\n");
-    return false;
+/**
+ * Gets "inf->strm" ready for a new zlib stream, resetting it if an earlier
+ * image already set it up.
+ */
+int reset_stream(INFLATER *inf) {
+  if (inf->strm_ready) {
+    return inflateReset(&inf->strm);
+  }
+  memset(&inf->strm, 0, sizeof(inf->strm));
+  // zlib's own allocations are counted too
+  inf->strm.zalloc = counting_zalloc;
+  inf->strm.zfree = counting_zfree;
+  inf->strm.opaque = inf;
+  int z_result = inflateInit(&inf->strm);
+  inf->strm_ready = z_result == Z_OK;
+  return z_result;
+}
+
+/**
+ * Grows "*buf" to at least "size" bytes, keeping it if it is big enough.
+ */
+static bool grow_buffer(uint8_t **buf, size_t *buf_size, size_t size,
+                        PNG_Stats *stats) {
+  if (size <= *buf_size) {
+    return true;
   }
-  size_t num_bytes = 3 * (size_t)hdr->width * (size_t)hdr->height;
-  *pixels = (uint8_t *)malloc(num_bytes);
-  if (!*pixels) {
-    printf("Error allocating pixels for upscale_to_8.\n");
+  uint8_t *grown = realloc(*buf, size);
+  if (!grown) {
+    fprintf(stderr, "malloc failed for buffer size %zu\n", size);
     return false;
   }
-  int samples_per_byte;
-  int bd_index;
-  uint8_t mask;
-  if (hdr->bit_depth == 4) {
-    samples_per_byte = 2;
-    bd_index = 2;
-    mask = 0b00001111;
-  } else if (hdr->bit_depth == 2) {
-    samples_per_byte = 4;
-    bd_index = 1;
-    mask = 0b00000011;
-  } else if (hdr->bit_depth == 1) {
-    samples_per_byte = 8;
-    bd_index = 0;
-    mask = 0b00000001;
-  } else {
-    printf("Unexpected bit depth for upscaling grayscale pixels: %d.  This "
-           "message probably shouldn't print.\n",
-           hdr->bit_depth);
-    free(*pixels);
-    return false;
+  stats_alloc(stats, PNG_STAGE_INFLATE, 1);
+  *buf = grown;
+  *buf_size = size;
+  return true;
+}
+
+/**
+ * Sizes the buffers from the header and sets up the z_stream.  The rows will
+ * be written to "inf->pixels", which must be set by now.
+ * Called when the first IDAT chunk arrives.
+ */
+int start_inflater(INFLATER *inf, PNG_IHDR *hdr) {
+  if (hdr->interlace_method != 0) {
+    // rows are unfiltered as they arrive, which assumes one pass of equal
+    // length rows
+    fprintf(stderr, "Interlaced png support not yet implemented.\n");
+    return Z_DATA_ERROR;
+  }
+  size_t buffer_size = get_buffer_size(hdr->height, hdr->width, hdr->bit_depth,
+                                       hdr->pixel_format, &inf->bytes_per_row);
+  if (buffer_size == 0 || inf->bytes_per_row > UINT_MAX) {
+    fprintf(stderr, "Unsupported image dimensions.\n");
+    return Z_DATA_ERROR;
+  }
+  inf->hdr = hdr;
+  inf->bpp = get_bytes_per_pixel(hdr);
+  inf->height = hdr->height;
+  inf->rows = 0;
+  size_t len = inf->bytes_per_row - 1;
+  if (!grow_buffer(&inf->scanline, &inf->scanline_size, inf->bytes_per_row,
+                   inf->stats)) {
+    return Z_MEM_ERROR;
+  }
+  if (!inf->direct &&
+      !grow_buffer(&inf->row_buf, &inf->row_buf_size, len * 3, inf->stats)) {
+    return Z_MEM_ERROR;
+  }
+  int z_result = reset_stream(inf);
+  if (z_result != Z_OK) {
+    return z_result;
   }
-  int num_data_bytes_in_row =
-      (int)ceil((double)hdr->width / (double)samples_per_byte);
-  int end = samples_per_byte;
-  for (uint32_t i = 0; i < hdr->height; i++) {
-    uint32_t row_offset = i * hdr->width;
-    uint32_t data_row_offset = i * num_data_bytes_in_row;
-    for (uint32_t j = 0, m = 0; j < hdr->width; j += samples_per_byte, m++) {
-      int pixels_remaining = hdr->width - j;
-      int end = pixels_remaining < samples_per_byte ? pixels_remaining
-                                                    : samples_per_byte;
-      for (uint32_t k = 0; k < end; k++) {
-        int shift_multiplier = samples_per_byte - 1 - k;
-        int shift_amount = hdr->bit_depth * shift_multiplier;
-        uint8_t sub_byte = (data[data_row_offset + m] >> shift_amount) & mask;
-        uint8_t px = replicate_bits(sub_byte, hdr->bit_depth);
-        (*pixels)[(row_offset + j + k) * 3] = px;
-        (*pixels)[(row_offset + j + k) * 3 + 1] = px;
-        (*pixels)[(row_offset + j + k) * 3 + 2] = px;
-      }
+  inf->strm.next_out = inf->scanline;
+  inf->strm.avail_out = (uInt)inf->bytes_per_row;
+  inf->started = true;
+  inf->finished = false;
+  return Z_OK;
+}
+
+/**
+ * Converts the unfiltered row "raw" into "out", timing the 16 to 8 bit
+ * conversion and the expansion separately.
+ */
+void emit_row(INFLATER *inf, const uint8_t *raw, uint8_t *out) {
+  const PNG_IHDR *hdr = inf->hdr;
+  size_t len = inf->bytes_per_row - 1;
+  if (inf->as_is) {
+    uint64_t start = stats_start(inf->stats);
+    memcpy(out, raw, len);
+    stats_stop(inf->stats, PNG_STAGE_EXPAND, start, len);
+    return;
+  }
+  if (inf->png->depth == 16) {
+    uint64_t start = stats_start(inf->stats);
+    expand_row_16(hdr, raw, out);
+    stats_stop(inf->stats, PNG_STAGE_EXPAND, start, len);
+    return;
+  }
+  if (hdr->bit_depth == 16) {
+    // rows with a channel per sample, such as RGB(A), are done once they
+    // are 8 bit, so those go straight out
+    bool done = inf->row_size == len / 2;
+    uint8_t *narrow = done ? out : inf->row_buf + len * 2;
+    uint64_t start = stats_start(inf->stats);
+    convert_16_to_8(narrow, raw, len / 2);
+    stats_stop(inf->stats, PNG_STAGE_CONVERT16, start, len);
+    if (done) {
+      return;
     }
+    raw = narrow;
+    len /= 2;
   }
-  free(data);
-  return true;
+  uint64_t start = stats_start(inf->stats);
+  expand_row(hdr, inf->keep, raw, out);
+  stats_stop(inf->stats, PNG_STAGE_EXPAND, start, len);
 }
 
-bool upscale_to_8_plte(uint8_t **data, PNG_IHDR *hdr) {
-  if (!data || !hdr) {
-    printf("Null pointer passed to upscale_to_8_plte.\n");
+/**
+ * Points the inflater at "pixels", where the output function said rows from
+ * "row" on go.  Returns false, having said why, if they can't be used.
+ */
+bool set_rows(INFLATER *inf, const PNG_IHDR *hdr, uint32_t row,
+              uint8_t *pixels, size_t stride, uint32_t num_rows) {
+  size_t row_size = inf->row_size;
+  if (!pixels || num_rows == 0) {
+    fprintf(stderr, "No room given for row %u of the output.\n", row);
     return false;
   }
-  size_t num_bytes = (size_t)hdr->width * (size_t)hdr->height;
-  uint8_t *new_data = (uint8_t *)malloc(num_bytes);
-  if (!new_data) {
-    printf("Error allocating pallate for upscale_to_8_plte.\n");
+  if (stride < row_size) {
+    fprintf(stderr, "Output stride %zu is too small for rows of %zu bytes.\n",
+            stride, row_size);
     return false;
   }
-  int samples_per_byte;
-  int bd_index;
-  uint8_t mask;
-  if (hdr->bit_depth == 4) {
-    samples_per_byte = 2;
-    bd_index = 2;
-    mask = 0b00001111;
-  } else if (hdr->bit_depth == 2) {
-    samples_per_byte = 4;
-    bd_index = 1;
-    mask = 0b00000011;
-  } else if (hdr->bit_depth == 1) {
-    samples_per_byte = 8;
-    bd_index = 0;
-    mask = 0b00000001;
+  if (num_rows > hdr->height - row) {
+    num_rows = hdr->height - row;
+  }
+  inf->pixels = pixels;
+  inf->stride = stride;
+  inf->band_start = row;
+  inf->band_end = row + num_rows;
+  return true;
+}
+
+/**
+ * Calls the output function for the rows from "inf->rows" on, which also
+ * tells it the rows before are done.  Once every row is done it is called
+ * one last time, with "row" equal to the height, and the result ignored.
+ */
+uint8_t *call_output(INFLATER *inf, size_t *stride, uint32_t *num_rows) {
+  const PNG_IHDR *hdr = inf->hdr;
+  *stride = inf->stride;
+  *num_rows = hdr->height - inf->rows;
+  return inf->output(inf->output_user, inf->png, inf->rows, stride, num_rows);
+}
+
+/**
+ * Unfilters the scanline that was just completed, writes it out and points
+ * inflate at the next one.  Once every row is done inflate is given no more
+ * room, so any excess data shows up as Z_BUF_ERROR.
+ */
+bool finish_row(INFLATER *inf) {
+  size_t stride;
+  uint32_t num_rows;
+  if (inf->rows == inf->band_end) {
+    uint8_t *pixels = call_output(inf, &stride, &num_rows);
+    if (!set_rows(inf, inf->hdr, inf->rows, pixels, stride, num_rows)) {
+      return false;
+    }
+  }
+  size_t len = inf->bytes_per_row - 1;
+  uint8_t *out =
+      inf->pixels + (size_t)(inf->rows - inf->band_start) * inf->stride;
+  uint8_t *raw;
+  const uint8_t *prior;
+  if (inf->direct) {
+    raw = out;
+    prior = inf->rows == 0 ? NULL : out - inf->stride;
   } else {
-    printf("Unexpected bit depth for upscaling grayscale pixels: %d.  This "
-           "message probably shouldn't print.\n",
-           hdr->bit_depth);
-    free(new_data);
+    raw = inf->row_buf + (inf->rows & 1) * len;
+    prior = inf->rows == 0 ? NULL : inf->row_buf + (~inf->rows & 1) * len;
+  }
+  uint64_t start = stats_start(inf->stats);
+  bool ok = unfilter_row(raw, inf->scanline + 1, prior, len, inf->bpp,
+                         inf->scanline[0]);
+  stats_stop(inf->stats, PNG_STAGE_UNFILTER, start, len);
+  if (!ok) {
     return false;
   }
-  int num_data_bytes_in_row =
-      (int)ceil((double)hdr->width / (double)samples_per_byte);
-  int end = samples_per_byte;
-  for (uint32_t i = 0; i < hdr->height; i++) {
-    uint32_t row_offset = i * hdr->width;
-    uint32_t data_row_offset = i * num_data_bytes_in_row;
-    for (uint32_t j = 0, m = 0; j < hdr->width; j += samples_per_byte, m++) {
-      int pixels_remaining = hdr->width - j;
-      int end = pixels_remaining < samples_per_byte ? pixels_remaining
-                                                    : samples_per_byte;
-      for (uint32_t k = 0; k < end; k++) {
-        int shift_multiplier = samples_per_byte - 1 - k;
-        int shift_amount = hdr->bit_depth * shift_multiplier;
-        uint8_t sub_byte =
-            ((*data)[data_row_offset + m] >> shift_amount) & mask;
-        new_data[row_offset + j + k] = sub_byte;
-      }
-    }
+  if (!inf->direct) {
+    emit_row(inf, raw, out);
+  }
+  inf->rows++;
+  if (inf->rows == inf->height && inf->output) {
+    call_output(inf, &stride, &num_rows);
   }
-  free(*data);
-  *data = new_data;
+  inf->strm.next_out = inf->scanline;
+  inf->strm.avail_out = inf->rows < inf->height ? (uInt)inf->bytes_per_row : 0;
   return true;
 }
 
-bool get_pixels2(uint8_t *data, PNG_IHDR *hdr, uint8_t **pixels) {
-  // pixels should be an uninitialized pointer i think
-  if (!data || !hdr) {
-    fprintf(stderr, "Null pointer passed into get_pixels.\n");
-    return false;
-  }
-  uint8_t bit_depth = hdr->bit_depth;
-  switch (hdr->pixel_format) {
-  case RGB:
-  case RGBA:
-    if (bit_depth == 8 || bit_depth == 16) {
-      *pixels = data;
-      return true;
-    }
-    fprintf(stderr,
-            "Unsupported bit depth %d for color mode %d.  This message "
-            "probably shouldn't print.\n",
-            hdr->bit_depth, hdr->color_type);
-    break;
-  case PALETTE:
-    *pixels = (uint8_t *)malloc(hdr->width * hdr->height * 3);
-    if (!*pixels) {
-      fprintf(stderr, "Error allocating pixels.\n");
-      break;
-    }
-    if (bit_depth == 4 || bit_depth == 2 || bit_depth == 1) {
-      if (!upscale_to_8_plte(&data, hdr)) {
-        free(*pixels);
-        break;
-      }
+int run_inflate(INFLATER *inf, PNG_IHDR *hdr, const unsigned char *data,
+                size_t len) {
+  if (!inf->started) {
+    int z_result = start_inflater(inf, hdr);
+    if (z_result != Z_OK) {
+      return z_result;
     }
-    PLTE *pal = hdr->pal;
-    for (size_t y = 0; y < hdr->height; y++) {
-      size_t offset = y * hdr->width;
-      for (size_t x = 0; x < hdr->width; x++) {
-        uint8_t pal_idx = data[offset + x];
-        size_t px_offset = (offset + x) * 3;
-        (*pixels)[px_offset] = pal[pal_idx].r;
-        (*pixels)[px_offset + 1] = pal[pal_idx].g;
-        (*pixels)[px_offset + 2] = pal[pal_idx].b;
+  }
+  if (inf->finished) {
+    // data after the end of the zlib stream is ignored, as uncompress would
+    return Z_OK;
+  }
+  inf->strm.next_in = (Bytef *)data;
+  inf->strm.avail_in = (uInt)len;
+  while (inf->strm.avail_in > 0) {
+    int z_result = inflate(&inf->strm, Z_NO_FLUSH);
+    if (inf->strm.avail_out == 0 && inf->rows < inf->height) {
+      if (!finish_row(inf)) {
+        return Z_DATA_ERROR;
       }
     }
-    free(data);
-    return true;
-    break;
-  case GSA:
-    *pixels = (uint8_t *)malloc(hdr->width * hdr->height * 4);
-    if (!*pixels) {
-      fprintf(stderr, "Error allocating pixels.\n");
+    if (z_result == Z_STREAM_END) {
+      inf->finished = true;
       break;
     }
-    for (uint32_t y = 0; y < hdr->height; y++) {
-      uint32_t offset = y * hdr->width * 2;
-      for (uint32_t x = 0; x < (hdr->width * 2); x += 2) {
-        uint32_t px_offset = (y * hdr->width + x / 2) * 4;
-        (*pixels)[px_offset] = data[offset + x];
-        (*pixels)[px_offset + 1] = data[offset + x];
-        (*pixels)[px_offset + 2] = data[offset + x];
-        (*pixels)[px_offset + 3] = data[offset + x + 1];
-      }
+    if (z_result == Z_BUF_ERROR && inf->strm.avail_out == 0) {
+      fprintf(stderr, "Image data inflates past the expected size.\n");
+      return Z_BUF_ERROR;
     }
-    free(data);
-    return true;
-    break;
-  case GS:
-    if (bit_depth == 8 || bit_depth == 16) {
-      *pixels = (uint8_t *)malloc(hdr->width * hdr->height * 3);
-      if (!*pixels) {
-        fprintf(stderr, "Error allocating pixels.\n");
-        break;
-      }
-      for (uint32_t y = 0; y < hdr->height; y++) {
-        uint32_t offset = y * hdr->width;
-        for (uint32_t x = 0; x < hdr->width; x++) {
-          uint32_t px_offset = (offset + x) * 3;
-          (*pixels)[px_offset] = data[offset + x];
-          (*pixels)[px_offset + 1] = data[offset + x];
-          (*pixels)[px_offset + 2] = data[offset + x];
-        }
-      }
-      free(data);
-      return true;
+    if (z_result != Z_OK) {
+      fprintf(stderr, "inflate result: %d\n", z_result);
+      return z_result;
     }
-    if (bit_depth == 4 || bit_depth == 2 || bit_depth == 1) {
-      if (!upscale_to_8(data, hdr, pixels)) {
-        break;
-      }
-      return true;
-    }
-    fprintf(stderr,
-            "Unsupported bit depth %d for color mode %d.  This message "
-            "probably shouldn't print.\n",
-            hdr->bit_depth, hdr->color_type);
-    break;
-  default:
-    printf("Unknown pixel format.  This message probably shouldn't print.\n");
-    break;
   }
-  free(data);
-  return false;
+  return Z_OK;
+}
+
+/**
+ * Time charged so far to the stages a row goes through once inflated.  An
+ * output function may charge its own upload time to PNG_STAGE_UPLOAD.
+ */
+static uint64_t row_stages_ns(const PNG_Stats *stats) {
+  return stats_ns(stats, PNG_STAGE_UNFILTER) +
+         stats_ns(stats, PNG_STAGE_CONVERT16) +
+         stats_ns(stats, PNG_STAGE_EXPAND) + stats_ns(stats, PNG_STAGE_UPLOAD);
+}
+
+/**
+ * Feeds the payload of one IDAT chunk to the inflater, unfiltering and
+ * writing out every scanline it completes along the way.  Those stages are
+ * timed on their own and left out of the inflate time.
+ * Returns Z_OK if all of it was consumed, a zlib error code otherwise.
+ */
+int inflate_idat(INFLATER *inf, PNG_IHDR *hdr, const unsigned char *data,
+                 size_t len) {
+  uint64_t start = stats_start(inf->stats);
+  uint64_t row_ns = row_stages_ns(inf->stats);
+  int z_result = run_inflate(inf, hdr, data, len);
+  stats_stop_outer(inf->stats, PNG_STAGE_INFLATE, start, len,
+                   row_stages_ns(inf->stats) - row_ns);
+  return z_result;
+}
+
+/**
+ * Checks the zlib stream ended right after the last scanline, which means
+ * every row has been written out.
+ */
+int finish_inflater(INFLATER *inf) {
+  if (!inf->started) {
+    fprintf(stderr, "No IDAT chunks found.\n");
+    return Z_DATA_ERROR;
+  }
+  if (!inf->finished || inf->rows != inf->height) {
+    fprintf(stderr, "Image data ended early (%u of %u rows).\n", inf->rows,
+            inf->height);
+    free_inflater(inf);
+    return Z_DATA_ERROR;
+  }
+  inf->pixels = NULL;
+  inf->started = false;
+  return Z_OK;
+}
+
+int PNG_channels(const PNG *png) { return png->channels; }
+
+int PNG_depth(const PNG *png) { return png->depth; }
+
+size_t PNG_row_size(const PNG *png) {
+  return ((size_t)png->header->width * png->channels * png->depth + 7) / 8;
 }
 
 void free_PNG(PNG *p) {
   if (!p) {
     return;
   }
-  if (p->pixels) {
-    free(p->pixels);
-  }
-  free_IHDR(p->header);
-  p->header = NULL;
-  p->pixels = NULL;
-  p = NULL;
+  PNG_crc_wait(p);
+  // p itself, its header and pixels all live in the arena
+  arena_free(p->arena);
 }
 
-bool unfilter_data(uint8_t *raw_data, uint8_t *out_data, PNG_IHDR *hdr,
-                   size_t bytes_per_row) {
-  uint32_t bps; // bytes per sample, minimum 1 (for sample depth < 8 should
-                // still be fine)
-  uint32_t spp; // samples per pixel, minimum 1
-  uint8_t bd = hdr->bit_depth;
-  if (bd == 16) {
+/**
+ * Returns the number of bytes per complete pixel, rounded up to 1 for bit
+ * depths below 8.  This is the distance filters look back for "left".
+ * Returns 0 for an unknown pixel format.
+ */
+size_t get_bytes_per_pixel(PNG_IHDR *hdr) {
+  size_t bps; // bytes per sample, minimum 1 (for sample depth < 8 should
+              // still be fine)
+  size_t spp; // samples per pixel, minimum 1
+  if (hdr->bit_depth == 16) {
     bps = 2;
   } else {
     bps = 1;
@@ -938,492 +1146,578 @@ bool unfilter_data(uint8_t *raw_data, uint8_t *out_data, PNG_IHDR *hdr,
     spp = 1;
     break;
   default:
-    fprintf(stderr,
-            "Unknown pixel format.  This message probably shouldn't print.\n");
-    return false;
+    return 0;
     break;
   }
+  return spp * bps;
+}
 
-  for (uint32_t i = 0; i < hdr->height; i++) {
-    uint32_t f_offset = i * bytes_per_row;
-    uint32_t r_row_len = bytes_per_row - 1;
-    uint32_t r_offset = i * r_row_len;
-    uint8_t filter_type = out_data[f_offset];
-    switch (filter_type) {
-    case 0: // none-type filter (data just needs to be copied as is)
-      for (uint32_t j = 0; j < r_row_len; j++) {
-        raw_data[r_offset + j] = out_data[f_offset + j + 1];
-      }
-      break;
-    case 1: // sub-type filter
-            //(first pixel data is copied as is, then add the raw unfiltered
-            // data from previous pixel to undo the sub filter)
-      for (uint32_t j = 0; j < r_row_len; j++) {
-        if (j < spp * bps) {
-          raw_data[r_offset + j] = out_data[f_offset + j + 1];
-          continue;
-        }
-        raw_data[r_offset + j] =
-            out_data[f_offset + j + 1] + raw_data[r_offset + j - (spp * bps)];
-      }
-      break;
-    case 2: // above-type filter
-            // (first pixel data copied as is, then add raw unfiltered
-            // data from previous row pixel to undo the filter)
-      for (uint32_t j = 0; j < r_row_len; j++) {
-        if (i == 0) {
-          raw_data[r_offset + j] = out_data[f_offset + j + 1];
-          continue;
-        }
-        raw_data[r_offset + j] =
-            out_data[f_offset + j + 1] + raw_data[r_offset - r_row_len + j];
-      }
-      break;
-    case 3:
-      // raw(x) = average + floor((raw(x-bpp)+prior(x))/2)
-      for (uint32_t j = 0; j < r_row_len; j++) {
-        if (i == 0 && j < spp * bps) {
-          // first pixel -> raw(0) = average(0) + floor(0 + 0)
-          raw_data[r_offset + j] = out_data[f_offset + j + 1];
-          continue;
-        }
-        if (i == 0) {
-          uint8_t average = raw_data[r_offset + j - (spp * bps)] >> 1;
-          raw_data[r_offset + j] = out_data[f_offset + j + 1] + average;
-          continue;
-        }
-        if (j < (spp)) {
-          uint8_t average = raw_data[r_offset - r_row_len + j] >> 1;
-          raw_data[r_offset + j] = out_data[f_offset + j + 1] + average;
-          continue;
-        }
-        uint8_t average;
-        uint16_t a = (uint16_t)raw_data[r_offset - r_row_len + j];
-        uint16_t b = (uint16_t)raw_data[r_offset + j - (spp * bps)];
-        average = (uint8_t)((a + b) >> 1);
-        raw_data[r_offset + j] = out_data[f_offset + j + 1] + average;
-      }
-      break;
-    case 4:
-      for (uint32_t j = 0; j < r_row_len; j++) {
-        if (i == 0 && j < spp * bps) {
-          raw_data[r_offset + j] = out_data[f_offset + j + 1];
-          continue;
-        }
-        if (i == 0) {
-          // PaethPredictor(a, 0, 0) = a
-          uint8_t a = raw_data[r_offset + j - (spp * bps)];
-          raw_data[r_offset + j] = out_data[f_offset + j + 1] + a;
-          continue;
-        }
-        if (j < spp * bps) {
-          // PaethPredictor(0, b, 0) = b
-          uint8_t b = raw_data[r_offset - r_row_len + j];
-          raw_data[r_offset + j] = out_data[f_offset + j + 1] + b;
-          continue;
-        }
-        // PaethPredictor(left, up, up-left)
-        uint8_t left = raw_data[r_offset + j - (spp * bps)];
-        uint8_t up = raw_data[r_offset - r_row_len + j];
-        uint8_t up_left = raw_data[r_offset - r_row_len + j - (spp * bps)];
-        uint8_t p = out_data[f_offset + j + 1];
-        raw_data[r_offset + j] = p + PaethPredictor(left, up, up_left);
-      }
-      break;
-    default:
-      printf("Unsupported filter type for filter method 0.  This message "
-             "shouldn't appear.\n");
+/**
+ * Everything a decode needs to carry from one chunk to the next.
+ * Field "crc_mode" is the mode actually in effect, which can be weaker than
+ * the requested "opts.crc_mode" when a deferred check is not possible.
+ * Field "arena" is where everything the decode allocates comes from, it is
+ * handed over to the PNG at the end.
+ */
+struct PNG_Decoder {
+  PNG_Options opts;
+  PNG_CrcMode crc_mode;
+  ARENA *arena;
+  SOURCE src;
+  INFLATER inf;
+  bool idat_start;
+  bool idat_end;
+};
+
+/**
+ * Checks one chunk against what came before it and acts on it: IDAT data is
+ * inflated, gAMA and PLTE are copied into "hdr".  Nothing in "chunk" is
+ * needed afterwards.
+ * Returns false, having said why, if the png is invalid.
+ */
+bool process_chunk(PNG_Decoder *dec, PNG_IHDR *hdr, CHUNK *chunk) {
+  if (dec->idat_start && chunk->type != CHUNK_IDAT) {
+    dec->idat_end = true;
+  }
+  switch (chunk->type) {
+  case CHUNK_gAMA:
+    if (hdr->has_gama == true) {
+      fprintf(stderr, "ERROR: Multiple gAMA chunks detected.\n");
       return false;
-      break;
     }
-  }
-  return true;
-}
-
-void get_pass_dimensions(uint32_t *height, uint32_t *width, PNG_IHDR *hdr,
-                         uint32_t start_x, uint32_t start_y, uint32_t step_x,
-                         uint32_t step_y) {
-  *height = (hdr->height - start_y + step_y - 1) / step_y;
-  *width = (hdr->width - start_x + step_x - 1) / step_x;
-}
+    if (hdr->has_plte == true) {
+      fprintf(stderr, "ERROR: gAMA chunk must be placed before PLTE data.\n");
+      return false;
+    }
+    if (dec->idat_start == true) {
+      fprintf(stderr, "ERROR: gAMA chunk must be placed before IDAT data.\n");
+      return false;
+    }
+    hdr->has_gama = true;
+    hdr->gamma = *(uint32_t *)chunk->data;
+    break;
 
-//** Use for decompressing interlaced data ONLY.
-size_t get_pass_buf_size(PNG_IHDR *hdr, uint32_t start_x, uint32_t start_y,
-                         uint32_t step_x, uint32_t step_y) {
-  uint32_t height;
-  uint32_t width;
-  get_pass_dimensions(&height, &width, hdr, start_x, start_y, step_x, step_y);
-  if (height != 0 && width != 0) {
-    size_t *bytes_per_row; // throwaway
-    size_t pass_num_bytes = get_buffer_size(height, width, hdr->bit_depth,
-                                            hdr->pixel_format, bytes_per_row);
-    return pass_num_bytes;
-  }
-  return 0;
-}
-
-bool unfilter_interlace(uint8_t *raw_data, uint8_t *out_data, PNG_IHDR *hdr,
-                        size_t bytes_per_row) {
-  // TODO:
-  if (!raw_data || !out_data || !hdr) {
-    fprintf(stderr, "NULL pointer passed to unfilter_interlace().\n");
-    return false;
-  }
-  printf("Unfilter interlace start\n");
-  uint8_t *out_data_ptr = out_data;
-  uint8_t bit_depth = hdr->bit_depth;
-  PixelFormat pf = hdr->pixel_format;
-  size_t pass_1_bytes_per_row;
-  uint32_t pass_1_height;
-  uint32_t pass_1_width;
-  uint32_t pass_1_num_bytes = 0;
-  uint8_t *pass_1_out_data = NULL;
-
-  get_pass_dimensions(&pass_1_height, &pass_1_width, hdr, 0, 0, 8, 8);
-  if (pass_1_height != 0 && pass_1_width != 0) {
-    pass_1_num_bytes = (uint32_t)get_buffer_size(
-        pass_1_height, pass_1_width, bit_depth, pf, &pass_1_bytes_per_row);
-    pass_1_out_data = (uint8_t *)malloc((size_t)pass_1_num_bytes);
-    if (!pass_1_out_data) {
+  case CHUNK_PLTE: {
+    if (dec->idat_start) {
+      fprintf(stderr, "ERROR: PLTE chunk detected after IDAT chunks.\n");
+      return false;
+    }
+    if (hdr->color_type == 0 || hdr->color_type == 4) {
+      fprintf(stderr, "ERROR: PLTE chunk detected in grayscale png.\n");
+      return false;
+    }
+    if (hdr->has_plte == true) {
+      fprintf(stderr, "ERROR: Multiple PLTE chunks detected.\n");
+      return false;
+    }
+    uint32_t num_pal = chunk->length / 3;
+    uint32_t max_pal = hdr->color_type == 3 ? 1u << hdr->bit_depth : 256;
+    if (num_pal == 0) {
+      fprintf(stderr, "ERROR: Empty PLTE chunk.\n");
+      return false;
+    }
+    if (num_pal > max_pal) {
+      fprintf(stderr, "ERROR: Too many PLTE entries for bit depth!\n");
       return false;
     }
-    memcpy(pass_1_out_data, out_data_ptr, (size_t)pass_1_num_bytes);
-    out_data_ptr += pass_1_num_bytes;
-  }
-  // unfilter_data needs a PNG_IHDR* with bit_depth, pixel_format, and height
-  uint8_t *pass_1_raw_data = NULL;
-  if (pass_1_out_data != NULL) {
-    printf("unfiltering pass 1\n");
-    PNG_IHDR p1hdr;
-    p1hdr.bit_depth = bit_depth;
-    p1hdr.pixel_format = pf;
-    p1hdr.height = pass_1_height;
-    pass_1_raw_data = malloc(pass_1_num_bytes - pass_1_height);
-    if (!pass_1_raw_data) {
-      free(pass_1_out_data);
-      fprintf(stderr, "Error allocating memory for pass_1_out_data.\n");
+    hdr->has_plte = true;
+    hdr->num_pal = (uint16_t)num_pal;
+    memcpy(hdr->pal, chunk->data, (size_t)num_pal * sizeof(PLTE));
+    break;
+  }
+
+  case CHUNK_IDAT:
+    if (dec->idat_end) {
+      fprintf(stderr, "Non-contiguous IDAT chunks detected.  Bad PNG\n");
       return false;
     }
-    if (!unfilter_data(pass_1_raw_data, pass_1_out_data, &p1hdr,
-                       pass_1_bytes_per_row)) {
-      free(pass_1_raw_data);
-      free(pass_1_out_data);
-      fprintf(stderr, "Error unfiltering pass 1 interlace data.\n");
+    dec->idat_start = true;
+    if (inflate_idat(&dec->inf, hdr, chunk->data, chunk->length) != Z_OK) {
+      fprintf(stderr, "Error inflating IDAT data.\n");
       return false;
     }
-    free(pass_1_out_data);
-    pass_1_bytes_per_row--;
-    printf("Interlace pass 1 unfiltered.\n");
+    break;
+  }
+  return true;
+}
+
+/**
+ * Decides where the rows of "hdr" go: memory from the caller's output
+ * function if there is one and it provides any, otherwise a tightly packed
+ * buffer from the arena.  Points "png" and the inflater at it.
+ * Returns false, having said why, if there is nowhere to put them.
+ */
+bool setup_output(PNG_Decoder *dec, PNG *png, PNG_IHDR *hdr) {
+  INFLATER *inf = &dec->inf;
+  inf->keep = dec->opts.keep;
+  output_layout(hdr, inf->keep, &png->channels, &png->depth);
+  png->header = hdr;
+  size_t row_size = PNG_row_size(png);
+  size_t bytes_per_row;
+  if (get_buffer_size(hdr->height, hdr->width, hdr->bit_depth,
+                      hdr->pixel_format, &bytes_per_row) == 0) {
+    fprintf(stderr, "Unsupported image dimensions.\n");
+    return false;
+  }
+  // rows laid out just as the png has them
+  inf->as_is = png->depth == hdr->bit_depth && row_size == bytes_per_row - 1;
+  inf->png = png;
+  inf->row_size = row_size;
+  inf->hdr = hdr;
+  inf->rows = 0;
+  inf->stride = row_size;
+  inf->output = dec->opts.output;
+  inf->output_user = dec->opts.output_user;
+  if (inf->output) {
+    size_t stride;
+    uint32_t num_rows;
+    uint8_t *pixels = call_output(inf, &stride, &num_rows);
+    if (pixels) {
+      // rows in the caller's memory always go through the ring, it may be
+      // slow to read the prior row back from
+      inf->direct = false;
+      png->pixels = pixels;
+      png->stride = stride;
+      return set_rows(inf, hdr, 0, pixels, stride, num_rows);
+    }
+    inf->output = NULL;
+  }
+  if (row_size > SIZE_MAX / hdr->height) {
+    fprintf(stderr, "Unsupported image dimensions.\n");
+    return false;
   }
-  if (pass_1_raw_data) {
-    free(pass_1_raw_data);
+  uint8_t *pixels = stage_alloc(dec->arena, row_size * hdr->height,
+                                dec->opts.stats, PNG_STAGE_EXPAND);
+  if (!pixels) {
+    fprintf(stderr, "Error allocating pixels.\n");
+    return false;
   }
-  printf("Interlace png unfiltering not yet implemented.\n");
-  return false;
+  inf->direct = inf->as_is;
+  png->pixels = pixels;
+  png->stride = row_size;
+  return set_rows(inf, hdr, 0, pixels, row_size, hdr->height);
 }
 
-PNG *decode_PNG(FILE *f) {
-  if (get_file_size(f) < 45L) {
+/**
+ * Decodes the png in "dec->src", allocating from "dec->arena".  All state
+ * that has to survive from one chunk to the next lives in "dec", which is
+ * reset here, so a decoder can be used again and several decoders can run on
+ * different threads at once.  On failure the arena is left to the caller.
+ */
+PNG *decode_image(PNG_Decoder *dec) {
+  SOURCE *src = &dec->src;
+  dec->idat_start = false;
+  dec->idat_end = false;
+  dec->inf.started = false;
+  src->arena = dec->arena;
+
+  if (get_file_size(src) < 45L) {
     invalid_png();
-    printf("File size below minimum possible png size.\n");
+    fprintf(stderr, "File size below minimum possible png size.\n");
     return NULL;
   }
 
   // Check the signature for a valid png file
-  if (get_sig(f) != 1) {
+  if (get_sig(src) != 1) {
     invalid_png();
-    printf("Bad png signature.\n");
+    fprintf(stderr, "Bad png signature.\n");
     return NULL;
   }
-  CHUNK hdr_chunk = get_chunk(f);
-  if (hdr_chunk.length != 13 || (strcmp(hdr_chunk.type, "") == 0) ||
-      hdr_chunk.data == NULL) {
-    printf("Invalid IHDR.\n");
-    free_chunk_data(&hdr_chunk);
+  CHUNK hdr_chunk = get_chunk(src, dec->crc_mode, dec->opts.stats);
+  if (hdr_chunk.type != CHUNK_IHDR || hdr_chunk.data == NULL) {
+    fprintf(stderr, "Invalid IHDR.\n");
     return NULL;
   }
   PNG_IHDR *hdr_data = hdr_chunk.data;
   if (!verify_IHDR_data(hdr_data)) {
-    free_chunk_data(&hdr_chunk);
-    hdr_data = NULL;
     return NULL;
   }
-  hdr_data->pal = NULL;
+  hdr_data->num_pal = 0;
   hdr_data->has_plte = false;
   hdr_data->has_gama = false;
 
-  // TODO: Add interlacing support
   if (hdr_data->interlace_method != 0) {
-    printf("Interlaced png support not yet implemented.\n");
-    free_chunk_data(&hdr_chunk);
-    hdr_data = NULL;
+    fprintf(stderr, "Interlaced png support not yet implemented.\n");
     return NULL;
   }
 
   hdr_data->pixel_format = get_pixel_format(hdr_data);
   if (hdr_data->pixel_format == UNKNOWN) {
-    printf("Invalid color depth/bit depth combination.\n");
-    free_chunk_data(&hdr_chunk);
-    hdr_data = NULL;
+    fprintf(stderr, "Invalid color depth/bit depth combination.\n");
     return NULL;
   }
 
-  CHUNK *chunks = (CHUNK *)calloc(1, sizeof(CHUNK));
-  int i = 0;
-  do {
-    if (i != 0) {
-      CHUNK *tmp;
-      tmp = (CHUNK *)realloc(chunks, ((size_t)(1 + i) * sizeof(CHUNK)));
-      if (!tmp) {
-        if (i == 1) {
-          free_chunk_data(chunks);
-          free(chunks);
-          chunks = NULL;
-          hdr_data = NULL;
-          free_chunk_data(&hdr_chunk);
-          return NULL;
-        }
-        if (i != 1) {
-          free_chunks(chunks, i);
-          chunks = NULL;
-          hdr_data = NULL;
-          free_chunk_data(&hdr_chunk);
-          return NULL;
-        }
-      }
-      chunks = tmp;
-    }
-    chunks[i] = get_chunk(f);
-    if (idat_start && (strcmp(chunks[i].type, "PLTE") == 0)) {
-      printf("ERROR: PLTE chunk detected after IDAT chunks.\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
-      return NULL;
-    }
-    if (strcmp(chunks[i].type, "gAMA") == 0 && hdr_data->has_gama == true) {
-      printf("ERROR: Multiple gAMA chunks detected.\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
-      return NULL;
-    }
-    if (strcmp(chunks[i].type, "gAMA") == 0 && hdr_data->has_plte == true) {
-      printf("ERROR: gAMA chunk must be placed before PLTE data.\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
-      return NULL;
-    }
-    if (strcmp(chunks[i].type, "gAMA") == 0 && idat_start == true) {
-      printf("ERROR: gAMA chunk must be placed before IDAT data.\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
-      return NULL;
-    }
-    if (strcmp(chunks[i].type, "gAMA") == 0) {
-      hdr_data->has_gama = true;
-      hdr_data->gamma = *(uint32_t *)chunks[i].data;
-    }
-    if (strcmp(chunks[i].type, "PLTE") == 0 &&
-        (hdr_data->color_type == 0 || hdr_data->color_type == 4)) {
-      printf("ERROR: PLTE chunk detected in grayscale png.\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
-      return NULL;
-    }
-    if (strcmp(chunks[i].type, "PLTE") == 0 && hdr_data->has_plte == true) {
-      printf("ERROR: Multiple PLTE chunks detected.\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
+  PNG *png = stage_alloc(dec->arena, sizeof(PNG), dec->opts.stats,
+                         PNG_STAGE_PARSE);
+  if (!png) {
+    fprintf(stderr, "Error allocating memory\n");
+    return NULL;
+  }
+  memset(png, 0, sizeof(PNG));
+  if (!setup_output(dec, png, hdr_data)) {
+    return NULL;
+  }
+
+  // Each chunk is dealt with as soon as it is read and then let go of, so
+  // nothing but the header and the inflater grows with the file.
+  bool iend = false;
+  while (!iend) {
+    CHUNK chunk = get_chunk(src, dec->crc_mode, dec->opts.stats);
+    if (chunk.type == 0) {
+      // get_chunk has already said what was wrong with it
+      free_inflater(&dec->inf);
       return NULL;
     }
-    if (strcmp(chunks[i].type, "PLTE") == 0) {
-      hdr_data->has_plte = true;
-      hdr_data->num_pal = chunks[i].length / 3;
-      if (hdr_data->num_pal > (uint8_t)pow(2, hdr_data->bit_depth)) {
-        printf("ERROR: Too many PLTE entries for bit depth!\n");
-        free_chunks(chunks, i);
-        chunks = NULL;
-        hdr_data = NULL;
-        free_chunk_data(&hdr_chunk);
-        return NULL;
-      }
-      hdr_data->pal = chunks[i].data;
-    }
-    if (idat_start && (strcmp(chunks[i].type, "IDAT") != 0)) {
-      idat_end = true;
-    }
-    if (idat_end && (strcmp(chunks[i].type, "IDAT") == 0)) {
-      printf("Non-contiguous IDAT chunks detected.  Bad PNG\n");
-      free_chunks(chunks, i);
-      chunks = NULL;
-      hdr_data = NULL;
-      free_chunk_data(&hdr_chunk);
+    bool ok = process_chunk(dec, hdr_data, &chunk);
+    iend = chunk.type == CHUNK_IEND;
+    if (!ok) {
+      free_inflater(&dec->inf);
       return NULL;
     }
-    if (strcmp(chunks[i].type, "IDAT") == 0) {
-      idat_start = true;
-    }
-    i++;
-  } while (strcmp(chunks[i - 1].type, "IEND") != 0);
+  }
   if (hdr_data->color_type == 3 && hdr_data->has_plte == false) {
-    printf("ERROR: Color type 3 png must have a PLTE chunk!\n");
-    free_chunks(chunks, i);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+    fprintf(stderr, "ERROR: Color type 3 png must have a PLTE chunk!\n");
+    free_inflater(&dec->inf);
     return NULL;
   }
-  int num_chunks = i;
 
-  unsigned long num_bytes = 0L;
-  for (i = 0; i < num_chunks; i++) {
-    if (strcmp(chunks[i].type, "IDAT") == 0) {
-      num_bytes += chunks[i].length;
-    }
+  if (finish_inflater(&dec->inf) != Z_OK) {
+    fprintf(stderr, "Inflating image data failed.\n");
+    return NULL;
   }
-  unsigned char *compressed_data =
-      (unsigned char *)malloc(num_bytes * sizeof(char));
-  if (!compressed_data) {
-    printf("Error allocating data.\n");
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+  png->header = hdr_data;
+  png->bytes_per_row = dec->inf.bytes_per_row;
+  png->crc_check = NULL;
+  png->arena = dec->arena;
+
+  return png;
+}
+
+/**
+ * Runs decode_image in an arena of its own, which the PNG takes over, adding
+ * the whole decode to the stats if there are any.
+ */
+PNG *run_decoder(PNG_Decoder *dec) {
+  uint64_t start = stats_start(dec->opts.stats);
+  dec->arena = arena_new(dec->opts.arena, dec->opts.arena_size);
+  if (!dec->arena) {
+    fprintf(stderr, "Error allocating memory\n");
     return NULL;
   }
-  int offset = 0;
-  for (i = 0; i < num_chunks; i++) {
-    if (strcmp(chunks[i].type, "IDAT") != 0) {
-      continue;
+  // an arena that didn't fit in the caller's memory came from the heap
+  stats_alloc(dec->opts.stats, PNG_STAGE_PARSE, arena_heap_allocs(dec->arena));
+  PNG *png = decode_image(dec);
+  if (!png) {
+    arena_free(dec->arena);
+  }
+  dec->arena = NULL;
+  if (png && dec->opts.stats) {
+    dec->opts.stats->images++;
+    dec->opts.stats->total_ns += PNG_stats_clock() - start;
+  }
+  return png;
+}
+
+/**
+ * Background verification of every chunk CRC in a mapped file, used by
+ * PNG_CRC_DEFERRED.  The mapping belongs to the check until it is joined.
+ * Field "bad" counts the chunks whose CRC did not match, plus one if the
+ * chunk structure is broken.
+ */
+struct PNG_CrcCheck {
+  pthread_t thread;
+  const unsigned char *map;
+  size_t map_size;
+  int bad;
+};
+
+void *verify_chunk_crcs(void *arg) {
+  PNG_CrcCheck *check = arg;
+  size_t pos = 8;
+  while (pos + 12 <= check->map_size) {
+    uint32_t len;
+    uint32_t stored;
+    memcpy(&len, check->map + pos, 4);
+    len = ntohl(len);
+    if (len > MAX_DATA_LEN || len + 12 > check->map_size - pos) {
+      check->bad++;
+      break;
+    }
+    const unsigned char *type = check->map + pos + 4;
+    memcpy(&stored, type + 4 + len, 4);
+    if (crc(type, (size_t)len + 4) != ntohl(stored)) {
+      check->bad++;
+    }
+    pos += (size_t)len + 12;
+    if (FOURCC(type[0], type[1], type[2], type[3]) == CHUNK_IEND) {
+      break;
     }
-    memcpy(compressed_data + offset, chunks[i].data, chunks[i].length);
-    offset += chunks[i].length;
-  }
-  size_t out_size = 0;
-  size_t bytes_per_row = 0;
-  uint8_t *out_data;
-  if (decompress_pixels(compressed_data, num_bytes, hdr_data, &out_data,
-                        &out_size, &bytes_per_row) != Z_OK) {
-    printf("decompress_pixels failed\n");
-    free(compressed_data);
-    compressed_data = NULL;
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+  }
+  return NULL;
+}
+
+/**
+ * Starts verifying the CRCs of a mapped file on its own thread.
+ * Returns NULL if the thread could not be started.
+ */
+PNG_CrcCheck *start_crc_check(const unsigned char *map, size_t map_size) {
+  PNG_CrcCheck *check = calloc(1, sizeof(PNG_CrcCheck));
+  if (!check) {
+    return NULL;
+  }
+  check->map = map;
+  check->map_size = map_size;
+  if (pthread_create(&check->thread, NULL, verify_chunk_crcs, check) != 0) {
+    free(check);
     return NULL;
   }
+  return check;
+}
 
-  free(compressed_data);
-  compressed_data = NULL;
+/**
+ * Joins the verification thread, releases the mapping and the check.
+ * Returns the number of bad chunks found.
+ */
+int finish_crc_check(PNG_CrcCheck *check) {
+  pthread_join(check->thread, NULL);
+  int bad = check->bad;
+  munmap((void *)check->map, check->map_size);
+  free(check);
+  return bad;
+}
 
-  /**
-   * Total number of bytes holding pixel data.
-   **/
-  size_t raw_size = out_size - hdr_data->height;
-  // TODO: fix raw_size for interlaced data...
-  uint8_t *raw_data = calloc(raw_size, 1);
-  if (!raw_data) {
-    printf("Error allocating raw_data.\n");
-    if (out_data) {
-      free(out_data);
-    }
-    out_data = NULL;
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
-    return NULL;
+int PNG_crc_wait(PNG *png) {
+  if (!png || !png->crc_check) {
+    return 0;
   }
+  int bad = finish_crc_check(png->crc_check);
+  png->crc_check = NULL;
+  return bad;
+}
 
-  bool unfiltered = false;
+void PNG_default_options(PNG_Options *opts) {
+  memset(opts, 0, sizeof(PNG_Options));
+  opts->crc_mode = PNG_CRC_ALL;
+}
 
-  if (hdr_data->interlace_method == 0) {
-    unfiltered = unfilter_data(raw_data, out_data, hdr_data, bytes_per_row);
-  } else if (hdr_data->interlace_method == 1) {
-    // TODO:
-    unfiltered =
-        unfilter_interlace(raw_data, out_data, hdr_data, bytes_per_row);
+void init_decoder(PNG_Decoder *dec, const PNG_Options *opts) {
+  memset(dec, 0, sizeof(PNG_Decoder));
+  if (opts) {
+    dec->opts = *opts;
   } else {
-    fprintf(stderr, "Unsupported interlace method.\n");
-    free(raw_data);
-    raw_data = NULL;
-    if (out_data) {
-      free(out_data);
-      out_data = NULL;
-    }
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+    PNG_default_options(&dec->opts);
+  }
+  dec->inf.stats = dec->opts.stats;
+}
+
+/**
+ * Frees the buffers and zlib stream the decoder keeps between decodes.
+ */
+void release_decoder(PNG_Decoder *dec) {
+  end_inflater(&dec->inf);
+  free(dec->src.buf);
+  dec->src.buf = NULL;
+  dec->src.buf_size = 0;
+}
+
+/**
+ * Points the decoder's source at a new png, or at nothing once it is done.
+ * The read buffer is kept.
+ */
+void set_source(SOURCE *src, FILE *fp, const unsigned char *map,
+                size_t map_size) {
+  src->fp = fp;
+  src->map = map;
+  src->map_size = map_size;
+  src->pos = 0;
+  src->arena = NULL;
+}
+
+PNG_Decoder *PNG_decoder_new(const PNG_Options *opts) {
+  PNG_Decoder *dec = malloc(sizeof(PNG_Decoder));
+  if (!dec) {
+    fprintf(stderr, "Error allocating memory\n");
     return NULL;
   }
+  init_decoder(dec, opts);
+  return dec;
+}
+
+void PNG_decoder_free(PNG_Decoder *dec) {
+  if (!dec) {
+    return;
+  }
+  release_decoder(dec);
+  free(dec);
+}
+
+PNG *PNG_decoder_decode(PNG_Decoder *dec, FILE *f) {
+  dec->crc_mode = dec->opts.crc_mode;
+  if (dec->crc_mode == PNG_CRC_DEFERRED) {
+    // the chunks are gone by the time a background check could look at them
+    dec->crc_mode = PNG_CRC_ALL;
+  }
+  set_source(&dec->src, f, NULL, 0);
+  PNG *png = run_decoder(dec);
+  set_source(&dec->src, NULL, NULL, 0);
+  return png;
+}
 
-  if (!unfiltered) {
-    fprintf(stderr, "Error unfiltering decompressed data.\n");
-    fflush(stderr);
-    free(raw_data);
-    raw_data = NULL;
-    if (out_data) {
-      free(out_data);
-      out_data = NULL;
+/**
+ * Reads everything left in "fd" into a malloced buffer, for streams that
+ * can't be mapped or seeked.  Stores the number of bytes read in "size".
+ * Returns NULL on failure.
+ */
+unsigned char *read_all(int fd, size_t *size) {
+  size_t cap = 65536;
+  size_t len = 0;
+  unsigned char *data = malloc(cap);
+  if (!data) {
+    fprintf(stderr, "Error allocating memory\n");
+    return NULL;
+  }
+  for (;;) {
+    if (len == cap) {
+      unsigned char *bigger = realloc(data, cap * 2);
+      if (!bigger) {
+        fprintf(stderr, "Error allocating memory\n");
+        free(data);
+        return NULL;
+      }
+      data = bigger;
+      cap *= 2;
     }
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+    ssize_t n = read(fd, data + len, cap - len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read");
+      free(data);
+      return NULL;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += (size_t)n;
+  }
+  *size = len;
+  return data;
+}
+
+PNG *PNG_decoder_decode_path(PNG_Decoder *dec, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat");
+    close(fd);
     return NULL;
   }
-  free(out_data);
-  out_data = NULL;
 
-  if (hdr_data->bit_depth == 16) {
-    raw_data = convert_16_to_8(raw_data, raw_size, hdr_data->pixel_format);
-    raw_size /= 2;
+  void *map = MAP_FAILED;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (map == MAP_FAILED && !S_ISREG(st.st_mode)) {
+    // Pipes and the like can't be mapped or seeked, read them into memory.
+    size_t size;
+    unsigned char *data = read_all(fd, &size);
+    close(fd);
+    if (!data) {
+      return NULL;
+    }
+    PNG *png = PNG_decoder_decode_memory(dec, data, size);
+    free(data);
+    return png;
+  }
+  if (map == MAP_FAILED) {
+    // Empty or unmappable files are read the old way.
+    FILE *f = fdopen(fd, "rb");
+    if (!f) {
+      perror("fdopen");
+      close(fd);
+      return NULL;
+    }
+    PNG *png = PNG_decoder_decode(dec, f);
+    fclose(f);
+    return png;
+  }
+  close(fd);
+  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  dec->crc_mode = dec->opts.crc_mode;
+  PNG_CrcCheck *check = NULL;
+  if (dec->crc_mode == PNG_CRC_DEFERRED) {
+    check = start_crc_check(map, (size_t)st.st_size);
+    if (!check) {
+      dec->crc_mode = PNG_CRC_ALL;
+    }
   }
 
-  uint8_t *pixels = NULL;
-  // get_pixels2 will allocate data for pixels if necessary.
-  // it also frees raw_data (if necessary), even on failure
-  if (!get_pixels2(raw_data, hdr_data, &pixels)) {
-    raw_data = NULL;
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+  set_source(&dec->src, NULL, map, (size_t)st.st_size);
+  PNG *png = run_decoder(dec);
+  set_source(&dec->src, NULL, NULL, 0);
+  if (check && png) {
+    // the check unmaps the file once it is done with it
+    png->crc_check = check;
+    return png;
+  }
+  if (check) {
+    finish_crc_check(check);
     return NULL;
   }
-  raw_data = NULL;
+  munmap(map, (size_t)st.st_size);
+  return png;
+}
 
-  PNG *png = (PNG *)malloc(sizeof(PNG));
-  if (!png) {
-    if (pixels) {
-      free(pixels);
-    }
-    pixels = NULL;
-    free_chunks(chunks, num_chunks);
-    chunks = NULL;
-    hdr_data = NULL;
-    free_chunk_data(&hdr_chunk);
+PNG *PNG_decoder_decode_memory(PNG_Decoder *dec, const void *data,
+                               size_t size) {
+  if (!data) {
+    fprintf(stderr, "Null pointer passed into PNG_decoder_decode_memory.\n");
     return NULL;
   }
-  png->header = hdr_data;
-  png->pixels = pixels;
-  png->bytes_per_row = bytes_per_row;
+  dec->crc_mode = dec->opts.crc_mode;
+  if (dec->crc_mode == PNG_CRC_DEFERRED) {
+    // the caller's buffer can't be handed to a background check
+    dec->crc_mode = PNG_CRC_ALL;
+  }
+  set_source(&dec->src, NULL, data, size);
+  PNG *png = run_decoder(dec);
+  set_source(&dec->src, NULL, NULL, 0);
+  return png;
+}
+
+PNG *decode_PNG(FILE *f) { return decode_PNG_opts(f, NULL); }
+
+PNG *decode_PNG_opts(FILE *f, const PNG_Options *opts) {
+  PNG_Decoder dec;
+  init_decoder(&dec, opts);
+  PNG *png = PNG_decoder_decode(&dec, f);
+  release_decoder(&dec);
+  return png;
+}
+
+PNG *decode_PNG_path(const char *path) {
+  return decode_PNG_path_opts(path, NULL);
+}
+
+PNG *decode_PNG_path_opts(const char *path, const PNG_Options *opts) {
+  PNG_Decoder dec;
+  init_decoder(&dec, opts);
+  PNG *png = PNG_decoder_decode_path(&dec, path);
+  release_decoder(&dec);
+  return png;
+}
 
-  free_chunks(chunks, num_chunks);
-  png->header->pal = NULL;
-  chunks = NULL;
+PNG *decode_PNG_memory(const void *data, size_t size,
+                       const PNG_Options *opts) {
+  PNG_Decoder dec;
+  init_decoder(&dec, opts);
+  PNG *png = PNG_decoder_decode_memory(&dec, data, size);
+  release_decoder(&dec);
   return png;
 }
@@ -1,6 +1,9 @@
 #ifndef PNG_H
 #define PNG_H
-#include "main.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef enum {
   UNKNOWN,
@@ -17,9 +20,11 @@ typedef struct {
 
 /**
  * Holds IHDR chunk data. See https://www.rfc-editor.org/rfc/rfc2083#page-15
+ * The palette from the PLTE chunk, if any, is kept here too: the first
+ * "num_pal" entries of "pal" are valid and the rest are zero.
  */
 typedef struct {
-  PLTE *pal;
+  PLTE pal[256];
   uint32_t width;
   uint32_t height;
   uint32_t gamma; // gamma * 100000
@@ -29,18 +34,219 @@ typedef struct {
   uint8_t compression_method;
   uint8_t filter_method;
   uint8_t interlace_method;
-  uint8_t num_pal;
+  uint16_t num_pal;
   bool has_plte;
   bool has_gama;
 } PNG_IHDR;
 
+/**
+ * Which chunk CRCs are checked while decoding.
+ * PNG_CRC_ALL checks every chunk, PNG_CRC_SKIP_IDAT every chunk but IDAT and
+ * PNG_CRC_CRITICAL only IHDR, PLTE and IEND.
+ * PNG_CRC_DEFERRED checks nothing while decoding, instead every chunk is
+ * verified on a background thread and the result collected with
+ * PNG_crc_wait.  Only mapped files can be deferred, decode_PNG_opts treats it
+ * as PNG_CRC_ALL.
+ */
+typedef enum {
+  PNG_CRC_ALL,
+  PNG_CRC_SKIP_IDAT,
+  PNG_CRC_CRITICAL,
+  PNG_CRC_DEFERRED,
+} PNG_CrcMode;
+
+/**
+ * Decode stages that can be timed.  PNG_STAGE_UPLOAD is never filled in by
+ * the decoder, it is there for the caller's own texture upload.  Time an
+ * output function charges to it is left out of PNG_STAGE_INFLATE.
+ */
+typedef enum {
+  PNG_STAGE_PARSE,     // reading and validating chunks
+  PNG_STAGE_CRC,       // chunk CRCs checked during the decode
+  PNG_STAGE_INFLATE,   // zlib, excluding the unfiltering done in between
+  PNG_STAGE_UNFILTER,  // reversing the scanline filters
+  PNG_STAGE_CONVERT16, // 16 to 8 bit conversion
+  PNG_STAGE_EXPAND,    // unpacking, palette lookup and gray to RGB(A)
+  PNG_STAGE_UPLOAD,
+  PNG_NUM_STAGES,
+} PNG_Stage;
+
+/**
+ * Field "bytes" is what the stage consumed (compressed bytes for inflate,
+ * pixel bytes for the others), "allocs" the heap allocations made by the
+ * stage, including zlib's and new blocks for the decode's arena.  Carving
+ * from an arena block that is already there costs nothing and isn't counted.
+ */
+typedef struct {
+  uint64_t ns;
+  uint64_t bytes;
+  uint64_t allocs;
+} PNG_StageStats;
+
+/**
+ * Counters added to by every decode given this struct through PNG_Options.
+ * A deferred CRC check runs on its own thread and isn't counted.  One struct
+ * must not be shared by decodes running at the same time, give each thread
+ * its own and combine them with PNG_stats_merge.
+ */
+typedef struct {
+  PNG_StageStats stages[PNG_NUM_STAGES];
+  uint64_t images;
+  uint64_t total_ns;
+} PNG_Stats;
+
+/**
+ * Ways the decoded pixels can be left closer to how the png stores them, for
+ * callers that finish the job themselves, such as in a shader.  Without any
+ * every image comes out as 8 bit RGB, or RGBA if it has alpha.
+ * PNG_KEEP_INDICES gives palette images one byte per pixel, the index into
+ * hdr->pal, unpacked from 1, 2 or 4 bits if need be.
+ * PNG_KEEP_PACKED leaves 1, 2 and 4 bit gray samples, and palette indices
+ * if they are being kept, packed as the png stores them: several to a byte,
+ * the leftmost pixel in the most significant bits, gray not scaled up.
+ * PNG_KEEP_GRAY gives gray images a single channel, or gray and alpha,
+ * instead of repeating the gray in red, green and blue.
+ * PNG_KEEP_16 leaves 16 bit samples at 16 bits, big-endian as the png
+ * stores them, rather than scaling them down to 8.
+ */
+typedef enum {
+  PNG_KEEP_INDICES = 1 << 0,
+  PNG_KEEP_PACKED = 1 << 1,
+  PNG_KEEP_GRAY = 1 << 2,
+  PNG_KEEP_16 = 1 << 3,
+} PNG_Keep;
+
+typedef struct PNG PNG;
+
+/**
+ * Asks the caller where rows of pixels should go, starting with "row".
+ * "png" has its header and the layout of its pixels (PNG_channels,
+ * PNG_depth) filled in, its pixels are what this provides.  Returns the
+ * address of that row, sets "*stride" to the number of bytes from one row
+ * to the next, at least PNG_row_size, and may lower "*num_rows", which
+ * starts out as every row left, to the number of rows there is room for.
+ * It is first called once the header has been read (the palette hasn't been
+ * yet) with "row" 0, where returning NULL has the decoder allocate the pixels
+ * as usual.  After that it is called again whenever the rows it made room for
+ * have all been written, which means they are done, and once more with "row"
+ * equal to the height after the last row, when the return value is ignored.
+ * Rows are written once each, top to bottom, and a decode that fails may
+ * have written some of them.
+ */
+typedef uint8_t *(*PNG_OutputFn)(void *user, const PNG *png, uint32_t row,
+                                 size_t *stride, uint32_t *num_rows);
+
+/**
+ * Field "stats" is NULL unless per-stage counters are wanted, in which case
+ * the decode adds to it.  Field "keep" is a set of PNG_Keep flags.
+ * If "output" is set it is called with "output_user" to let the caller
+ * provide the memory for the pixels, see PNG_OutputFn.  That memory is
+ * still the caller's after free_PNG.
+ * Everything a decode allocates, the returned PNG included, comes from one
+ * arena that free_PNG releases in one go.  If "arena" is set, the
+ * "arena_size" bytes there are used before falling back to the heap.  That
+ * memory belongs to the PNG until free_PNG, so it can't be given to another
+ * decode before then.
+ */
 typedef struct {
+  PNG_CrcMode crc_mode;
+  PNG_Stats *stats;
+  void *arena;
+  size_t arena_size;
+  PNG_OutputFn output;
+  void *output_user;
+  unsigned keep;
+} PNG_Options;
+
+void PNG_stats_reset(PNG_Stats *stats);
+void PNG_stats_merge(PNG_Stats *into, const PNG_Stats *from);
+const char *PNG_stage_name(PNG_Stage stage);
+/**
+ * Monotonic clock in nanoseconds, for timing stages outside the decoder.
+ */
+uint64_t PNG_stats_clock(void);
+/**
+ * Prints "stats" as a table, or as a single JSON object if "json" is set.
+ */
+void PNG_stats_print(const PNG_Stats *stats, FILE *f, bool json);
+
+typedef struct PNG_CrcCheck PNG_CrcCheck;
+
+struct PNG {
   PNG_IHDR *header;
-  uint8_t *pixels;
+  uint8_t *pixels; // what an output function first returned, if it was used
+  size_t stride;   // bytes from one row of pixels to the next
   size_t bytes_per_row;
-} PNG;
+  int channels; // see PNG_channels
+  int depth;    // see PNG_depth
+  PNG_CrcCheck *crc_check; // pending deferred CRC check, if any
+  struct ARENA *arena;     // holds the PNG itself, header and pixels
+};
+
+void PNG_default_options(PNG_Options *opts);
+
+/**
+ * A decoder owns all the state of a decode in progress.  One decoder decodes
+ * one file at a time, but any number of decoders can be used concurrently
+ * from different threads.  The decode_PNG functions below use a temporary
+ * decoder of their own.
+ * A decoder keeps its zlib stream and scratch buffers from one decode to the
+ * next, so once it has seen an image as large as the current one the only
+ * memory a decode allocates is the arena of the PNG it returns.
+ * "opts" may be NULL for the defaults.
+ */
+typedef struct PNG_Decoder PNG_Decoder;
+PNG_Decoder *PNG_decoder_new(const PNG_Options *opts);
+void PNG_decoder_free(PNG_Decoder *dec);
+PNG *PNG_decoder_decode(PNG_Decoder *dec, FILE *f);
+PNG *PNG_decoder_decode_path(PNG_Decoder *dec, const char *path);
+/**
+ * Decodes a png held in memory, parsing the chunks in place like
+ * PNG_decoder_decode_path.  "data" is only read during the call.
+ * PNG_CRC_DEFERRED is treated as PNG_CRC_ALL.
+ */
+PNG *PNG_decoder_decode_memory(PNG_Decoder *dec, const void *data,
+                               size_t size);
 
 PNG *decode_PNG(FILE *f);
+/**
+ * Same as decode_PNG, but maps the file at "path" into memory and parses the
+ * chunks in place instead of reading and copying each one.
+ */
+PNG *decode_PNG_path(const char *path);
+/**
+ * Variants of the above taking decode options, NULL means the defaults.
+ */
+PNG *decode_PNG_opts(FILE *f, const PNG_Options *opts);
+PNG *decode_PNG_path_opts(const char *path, const PNG_Options *opts);
+PNG *decode_PNG_memory(const void *data, size_t size,
+                       const PNG_Options *opts);
+
+/**
+ * Waits for a deferred CRC check to finish.
+ * Returns the number of chunks that failed it, 0 if there was no check.
+ */
+int PNG_crc_wait(PNG *png);
+/**
+ * Number of channels per pixel in png->pixels, which holds rows of width
+ * pixels png->stride bytes apart, each channel PNG_depth bits: 4 (RGBA) for
+ * formats with alpha, 3 (RGB) otherwise, or as few as the png has where
+ * PNG_Keep flags asked for that, 1 for palette indices or gray and 2 for
+ * gray with alpha.  The rows are tightly packed unless the caller provided
+ * the memory.
+ */
+int PNG_channels(const PNG *png);
+/**
+ * Bits per channel in png->pixels: 8, or the png's own 1, 2 or 4 bits for
+ * samples kept with PNG_KEEP_PACKED, or 16 for samples kept with
+ * PNG_KEEP_16.
+ */
+int PNG_depth(const PNG *png);
+/**
+ * Bytes taken up by one row of png->pixels, not counting any padding up to
+ * png->stride.
+ */
+size_t PNG_row_size(const PNG *png);
 void free_PNG(PNG *p);
 
 #endif // PNG
@@ -0,0 +1,243 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  pool_task_fn fn;
+  void *arg;
+} TASK;
+
+/**
+ * Growable ring of tasks.  The owning worker pushes and pops at the tail,
+ * thieves take from the head.  Field "count" is the number of queued tasks.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  TASK *tasks;
+  size_t cap;
+  size_t head;
+  size_t count;
+} DEQUE;
+
+/**
+ * Field "queued" counts tasks sitting in deques and "pending" tasks that have
+ * been submitted but not finished.  Both are guarded by "lock", which idle
+ * workers sleep on through "work_cv".
+ */
+struct POOL {
+  pthread_t *threads;
+  DEQUE *deques;
+  int num_workers;
+  int started;
+  unsigned next;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;
+  pthread_cond_t done_cv;
+  size_t queued;
+  size_t pending;
+  bool shutdown;
+};
+
+typedef struct {
+  POOL *pool;
+  int index;
+} WORKER;
+
+static bool push_task(DEQUE *d, TASK t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 64;
+    TASK *tasks = malloc(cap * sizeof(TASK));
+    if (!tasks) {
+      pthread_mutex_unlock(&d->lock);
+      return false;
+    }
+    for (size_t i = 0; i < d->count; i++) {
+      tasks[i] = d->tasks[(d->head + i) % d->cap];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->cap = cap;
+    d->head = 0;
+  }
+  d->tasks[(d->head + d->count) % d->cap] = t;
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+  return true;
+}
+
+static bool pop_task(DEQUE *d, TASK *t) {
+  bool found = false;
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0) {
+    d->count--;
+    *t = d->tasks[(d->head + d->count) % d->cap];
+    found = true;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static bool steal_task(DEQUE *d, TASK *t) {
+  bool found = false;
+  pthread_mutex_lock(&d->lock);
+  if (d->count > 0) {
+    *t = d->tasks[d->head];
+    d->head = (d->head + 1) % d->cap;
+    d->count--;
+    found = true;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+/**
+ * Takes a task from the worker's own deque, or failing that steals one,
+ * trying the other workers in turn starting with the next one along.
+ */
+static bool find_task(POOL *pool, int self, TASK *t) {
+  if (pop_task(&pool->deques[self], t)) {
+    return true;
+  }
+  for (int i = 1; i < pool->num_workers; i++) {
+    if (steal_task(&pool->deques[(self + i) % pool->num_workers], t)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void *worker_main(void *arg) {
+  WORKER *w = arg;
+  POOL *pool = w->pool;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued == 0 && !pool->shutdown) {
+      pthread_cond_wait(&pool->work_cv, &pool->lock);
+    }
+    if (pool->queued == 0 && pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    TASK t;
+    if (!find_task(pool, w->index, &t)) {
+      // another worker got there first
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    t.fn(t.arg, w->index);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending--;
+    if (pool->pending == 0) {
+      pthread_cond_broadcast(&pool->done_cv);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  free(w);
+  return NULL;
+}
+
+POOL *pool_new(int num_workers) {
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+  POOL *pool = calloc(1, sizeof(POOL));
+  if (!pool) {
+    return NULL;
+  }
+  pool->threads = calloc((size_t)num_workers, sizeof(pthread_t));
+  pool->deques = calloc((size_t)num_workers, sizeof(DEQUE));
+  if (!pool->threads || !pool->deques) {
+    free(pool->threads);
+    free(pool->deques);
+    free(pool);
+    return NULL;
+  }
+  pool->num_workers = num_workers;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cv, NULL);
+  pthread_cond_init(&pool->done_cv, NULL);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  }
+  for (int i = 0; i < num_workers; i++) {
+    WORKER *w = malloc(sizeof(WORKER));
+    if (!w) {
+      break;
+    }
+    w->pool = pool;
+    w->index = i;
+    if (pthread_create(&pool->threads[i], NULL, worker_main, w) != 0) {
+      free(w);
+      break;
+    }
+    pool->started++;
+  }
+  if (pool->started == 0) {
+    fprintf(stderr, "Unable to start any worker threads.\n");
+    pool_free(pool);
+    return NULL;
+  }
+  // Workers that failed to start leave their deques to be stolen from.
+  return pool;
+}
+
+int pool_num_workers(POOL *pool) { return pool->started; }
+
+bool pool_submit(POOL *pool, pool_task_fn fn, void *arg) {
+  TASK t = {fn, arg};
+  pthread_mutex_lock(&pool->lock);
+  unsigned target = pool->next++ % (unsigned)pool->num_workers;
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!push_task(&pool->deques[target], t)) {
+    return false;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&pool->work_cv);
+  pthread_mutex_unlock(&pool->lock);
+  return true;
+}
+
+void pool_wait(POOL *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done_cv, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_free(POOL *pool) {
+  if (!pool) {
+    return;
+  }
+  if (pool->started > 0) {
+    pool_wait(pool);
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work_cv);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->started; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  for (int i = 0; i < pool->num_workers; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_cv);
+  pthread_cond_destroy(&pool->done_cv);
+  free(pool->deques);
+  free(pool->threads);
+  free(pool);
+}
@@ -0,0 +1,35 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A task gets the argument it was submitted with and the index of the worker
+ * running it, in [0, num_workers), for per-worker state.
+ */
+typedef void (*pool_task_fn)(void *arg, int worker);
+
+/**
+ * Fixed size work-stealing thread pool.  Every worker has its own deque and
+ * takes the most recently queued task from it.  A worker whose deque is
+ * empty steals the oldest task from another worker, so a few slow tasks
+ * don't leave the other cores idle.
+ */
+typedef struct POOL POOL;
+
+POOL *pool_new(int num_workers);
+int pool_num_workers(POOL *pool);
+/**
+ * Queues a task.  Returns false if it could not be queued.
+ */
+bool pool_submit(POOL *pool, pool_task_fn fn, void *arg);
+/**
+ * Blocks until every submitted task has finished.
+ */
+void pool_wait(POOL *pool);
+/**
+ * Waits for outstanding tasks, then stops the workers and frees the pool.
+ */
+void pool_free(POOL *pool);
+
+#endif // POOL_H
@@ -0,0 +1,72 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+static const char *stage_names[PNG_NUM_STAGES] = {
+    "parse",     "crc",    "inflate", "unfilter",
+    "convert16", "expand", "upload",
+};
+
+void PNG_stats_reset(PNG_Stats *stats) { memset(stats, 0, sizeof(PNG_Stats)); }
+
+void PNG_stats_merge(PNG_Stats *into, const PNG_Stats *from) {
+  for (int i = 0; i < PNG_NUM_STAGES; i++) {
+    into->stages[i].ns += from->stages[i].ns;
+    into->stages[i].bytes += from->stages[i].bytes;
+    into->stages[i].allocs += from->stages[i].allocs;
+  }
+  into->images += from->images;
+  into->total_ns += from->total_ns;
+}
+
+const char *PNG_stage_name(PNG_Stage stage) {
+  if (stage < 0 || stage >= PNG_NUM_STAGES) {
+    return "unknown";
+  }
+  return stage_names[stage];
+}
+
+uint64_t PNG_stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t ns) {
+  return ns ? (double)bytes / 1e6 / ((double)ns / 1e9) : 0.0;
+}
+
+static void print_json(const PNG_Stats *stats, FILE *f) {
+  fprintf(f, "{\"images\": %llu, \"total_ms\": %.3f, \"stages\": {",
+          (unsigned long long)stats->images, (double)stats->total_ns / 1e6);
+  for (int i = 0; i < PNG_NUM_STAGES; i++) {
+    const PNG_StageStats *s = &stats->stages[i];
+    fprintf(f,
+            "%s\"%s\": {\"ms\": %.3f, \"bytes\": %llu, \"allocs\": %llu, "
+            "\"mb_per_s\": %.1f}",
+            i ? ", " : "", stage_names[i], (double)s->ns / 1e6,
+            (unsigned long long)s->bytes, (unsigned long long)s->allocs,
+            mb_per_s(s->bytes, s->ns));
+  }
+  fprintf(f, "}}\n");
+}
+
+void PNG_stats_print(const PNG_Stats *stats, FILE *f, bool json) {
+  if (json) {
+    print_json(stats, f);
+    return;
+  }
+  fprintf(f, "%-10s %10s %6s %12s %9s %7s\n", "stage", "ms", "%", "bytes",
+          "MB/s", "allocs");
+  for (int i = 0; i < PNG_NUM_STAGES; i++) {
+    const PNG_StageStats *s = &stats->stages[i];
+    double share =
+        stats->total_ns ? 100.0 * (double)s->ns / (double)stats->total_ns : 0.0;
+    fprintf(f, "%-10s %10.3f %5.1f%% %12llu %9.1f %7llu\n", stage_names[i],
+            (double)s->ns / 1e6, share, (unsigned long long)s->bytes,
+            mb_per_s(s->bytes, s->ns), (unsigned long long)s->allocs);
+  }
+  fprintf(f, "%-10s %10.3f  (%llu image%s decoded)\n", "total",
+          (double)stats->total_ns / 1e6, (unsigned long long)stats->images,
+          stats->images == 1 ? "" : "s");
+}
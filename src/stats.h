@@ -0,0 +1,59 @@
+#ifndef STATS_H
+#define STATS_H
+#include "png.h"
+
+/**
+ * Helpers for instrumenting the decoder.  All of them do nothing when
+ * "stats" is NULL, so a decode without stats pays one branch per call site
+ * and never reads the clock.
+ */
+static inline uint64_t stats_start(const PNG_Stats *stats) {
+  return stats ? PNG_stats_clock() : 0;
+}
+
+/**
+ * Charges the time since "start" and "bytes" to "stage".
+ * Returns the time charged.
+ */
+static inline uint64_t stats_stop(PNG_Stats *stats, PNG_Stage stage,
+                                  uint64_t start, uint64_t bytes) {
+  if (!stats) {
+    return 0;
+  }
+  uint64_t ns = PNG_stats_clock() - start;
+  stats->stages[stage].ns += ns;
+  stats->stages[stage].bytes += bytes;
+  return ns;
+}
+
+/**
+ * Total time charged to "stage" so far, for use with stats_stop_outer.
+ */
+static inline uint64_t stats_ns(const PNG_Stats *stats, PNG_Stage stage) {
+  return stats ? stats->stages[stage].ns : 0;
+}
+
+/**
+ * Same as stats_stop for a stage that contains others.  "inner_ns" is the
+ * time charged to those since "start", which is left out so no time is
+ * counted twice.
+ */
+static inline void stats_stop_outer(PNG_Stats *stats, PNG_Stage stage,
+                                    uint64_t start, uint64_t bytes,
+                                    uint64_t inner_ns) {
+  if (!stats) {
+    return;
+  }
+  uint64_t ns = PNG_stats_clock() - start;
+  stats->stages[stage].ns += ns > inner_ns ? ns - inner_ns : 0;
+  stats->stages[stage].bytes += bytes;
+}
+
+static inline void stats_alloc(PNG_Stats *stats, PNG_Stage stage,
+                               uint64_t count) {
+  if (stats) {
+    stats->stages[stage].allocs += count;
+  }
+}
+
+#endif // STATS_H
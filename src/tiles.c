@@ -0,0 +1,138 @@
+#include "tiles.h"
+#include "upload.h"
+#include <stdlib.h>
+
+static bool alloc_tiles(TILES *t, const PNG *png, uint32_t cols,
+                        uint32_t rows) {
+  t->tiles = calloc((size_t)cols * rows, sizeof(TILE));
+  if (!t->tiles) {
+    printf("Failed to allocate memory for tiles.\n");
+    return false;
+  }
+  t->cols = cols;
+  t->rows = rows;
+  t->png = png;
+  return true;
+}
+
+bool tiles_init(TILES *t, const PNG *png, PNG_Stats *stats) {
+  GLint max_size = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+  uint32_t size = TILE_SIZE;
+  if (max_size > 0 && (uint32_t)max_size < size) {
+    // a whole number of bytes when pixels are packed
+    size = (uint32_t)max_size & ~7u;
+  }
+  uint32_t width = png->header->width;
+  uint32_t height = png->header->height;
+  uint32_t cols = (width + size - 1) / size;
+  uint32_t rows = (height + size - 1) / size;
+  t->stats = stats;
+  if (!alloc_tiles(t, png, cols, rows)) {
+    return false;
+  }
+  for (uint32_t r = 0; r < rows; r++) {
+    for (uint32_t c = 0; c < cols; c++) {
+      TILE *tile = &t->tiles[(size_t)r * cols + c];
+      tile->x = c * size;
+      tile->y = r * size;
+      tile->width = width - tile->x < size ? width - tile->x : size;
+      tile->height = height - tile->y < size ? height - tile->y : size;
+    }
+  }
+  return true;
+}
+
+bool tiles_init_texture(TILES *t, const PNG *png, GLuint tex) {
+  t->stats = NULL;
+  if (!alloc_tiles(t, png, 1, 1)) {
+    return false;
+  }
+  t->tiles[0].tex = tex;
+  t->tiles[0].width = png->header->width;
+  t->tiles[0].height = png->header->height;
+  return true;
+}
+
+/**
+ * Copies the part of the image under "tile" into a new texture.
+ */
+static void upload_tile(TILES *t, TILE *tile) {
+  const PNG *png = t->png;
+  TEX_FORMAT f;
+  upload_format(png, &f);
+  uint32_t ppt = f.pixels_per_texel;
+  uint64_t start = t->stats ? PNG_stats_clock() : 0;
+
+  glGenTextures(1, &tile->tex);
+  glBindTexture(GL_TEXTURE_2D, tile->tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  upload_tex_params(&f);
+  // the tile is a window into the full rows of the image
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH,
+                (GLint)(png->stride / f.bytes_per_texel));
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, (GLint)(tile->x / ppt));
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, (GLint)tile->y);
+  upload_unpack(&f, true);
+  glTexImage2D(GL_TEXTURE_2D, 0, f.internal,
+               (GLsizei)((tile->width + ppt - 1) / ppt), (GLsizei)tile->height,
+               0, f.format, f.type, png->pixels);
+  upload_unpack(&f, false);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+  glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
+  GLenum err = glGetError();
+  if (err != GL_NO_ERROR) {
+    fprintf(stderr, "GL error 0x%x uploading the tile at %u,%u.\n", err,
+            tile->x, tile->y);
+  }
+  if (t->stats) {
+    PNG_StageStats *upload = &t->stats->stages[PNG_STAGE_UPLOAD];
+    upload->ns += PNG_stats_clock() - start;
+    upload->bytes += (uint64_t)(tile->width + ppt - 1) / ppt * tile->height *
+                     f.bytes_per_texel;
+  }
+}
+
+void tiles_draw(TILES *t, const VIEW *view, GLint rect_loc, GLint size_loc) {
+  double width = t->png->header->width;
+  double height = t->png->header->height;
+  double scale = 2.0 * view->zoom;
+  for (size_t i = 0; i < (size_t)t->cols * t->rows; i++) {
+    TILE *tile = &t->tiles[i];
+    // clip space, y up
+    double left = (tile->x / width - view->cx) * scale;
+    double right = ((tile->x + tile->width) / width - view->cx) * scale;
+    double top = (view->cy - tile->y / height) * scale;
+    double bottom = (view->cy - (tile->y + tile->height) / height) * scale;
+    if (right < -1.0 || left > 1.0 || top < -1.0 || bottom > 1.0) {
+      continue;
+    }
+    if (!tile->tex) {
+      upload_tile(t, tile);
+    }
+    glBindTexture(GL_TEXTURE_2D, tile->tex);
+    glUniform4f(rect_loc, (float)left, (float)bottom, (float)right,
+                (float)top);
+    glUniform2f(size_loc, (float)tile->width, (float)tile->height);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+  }
+}
+
+void tiles_free(TILES *t) {
+  if (!t->tiles) {
+    return;
+  }
+  for (size_t i = 0; i < (size_t)t->cols * t->rows; i++) {
+    if (t->tiles[i].tex) {
+      glDeleteTextures(1, &t->tiles[i].tex);
+    }
+  }
+  free(t->tiles);
+  t->tiles = NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef TILES_H
+#define TILES_H
+#include "png.h"
+#include <glad/gl.h>
+
+// edge of a tile in pixels, lowered to GL_MAX_TEXTURE_SIZE if that is less
+#define TILE_SIZE 2048
+
+/**
+ * Part of the image shown in the window.  "zoom" 1 fits the whole image to
+ * the window, and ("cx", "cy") is the point of the image at the center of
+ * the window, in fractions of the image's width and height from the top
+ * left.
+ */
+typedef struct {
+  double zoom;
+  double cx;
+  double cy;
+} VIEW;
+
+typedef struct {
+  GLuint tex; // 0 until the tile has been uploaded
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+} TILE;
+
+/**
+ * An image cut into a grid of textures, so it can be larger than
+ * GL_MAX_TEXTURE_SIZE.  Each tile is uploaded from "png" the first time it
+ * is drawn, so tiles that are never in view never take up video memory.
+ * Tile edges fall on byte boundaries of packed rows.
+ * Upload time and bytes are added to "stats" if it isn't NULL.
+ */
+typedef struct {
+  TILE *tiles;
+  uint32_t cols;
+  uint32_t rows;
+  const PNG *png;
+  PNG_Stats *stats;
+} TILES;
+
+/**
+ * Cuts "png" into tiles.  The PNG must outlive "t".
+ * Returns false, having said why, if the tiles couldn't be allocated.
+ */
+bool tiles_init(TILES *t, const PNG *png, PNG_Stats *stats);
+/**
+ * A single tile for "png" that is already in "tex".  "t" takes over "tex".
+ */
+bool tiles_init_texture(TILES *t, const PNG *png, GLuint tex);
+/**
+ * Draws the tiles that are in "view", uploading the ones that haven't been
+ * yet, with the bound program and vertex array.  "rect_loc" and "size_loc"
+ * are the locations of the program's "rect" and "size" uniforms, where each
+ * tile's corners and size in pixels go.  Either may be -1.
+ */
+void tiles_draw(TILES *t, const VIEW *view, GLint rect_loc, GLint size_loc);
+void tiles_free(TILES *t);
+
+#endif // TILES_H
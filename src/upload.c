@@ -0,0 +1,196 @@
+#include "upload.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+// rows are uploaded in bands of about this many bytes
+#define UPLOAD_BAND_SIZE (4 << 20)
+
+void upload_format(const PNG *png, TEX_FORMAT *f) {
+  static const GLint rgba[4] = {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA};
+  static const GLint gray[4] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+  static const GLint gray_alpha[4] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
+  static const GLint internal_8[4] = {GL_R8, GL_RG8, GL_RGB8, GL_RGBA8};
+  static const GLint internal_16[4] = {GL_R16, GL_RG16, GL_RGB16, GL_RGBA16};
+  static const GLenum formats[4] = {GL_RED, GL_RG, GL_RGB, GL_RGBA};
+  bool is_gray = png->header->pixel_format == GS ||
+                 png->header->pixel_format == GSA;
+  int channels = PNG_channels(png);
+  f->type = GL_UNSIGNED_BYTE;
+  f->pixels_per_texel = 1;
+  f->bytes_per_texel = (size_t)channels;
+  f->swap_bytes = false;
+  memcpy(f->swizzle, rgba, sizeof(rgba));
+  if (PNG_depth(png) < 8) {
+    f->bytes_per_texel = 1;
+    f->internal = GL_R8UI;
+    f->format = GL_RED_INTEGER;
+    f->pixels_per_texel = 8 / PNG_depth(png);
+    return;
+  }
+  f->internal = internal_8[channels - 1];
+  f->format = formats[channels - 1];
+  if (PNG_depth(png) == 16) {
+    f->internal = internal_16[channels - 1];
+    f->type = GL_UNSIGNED_SHORT;
+    f->bytes_per_texel *= 2;
+    f->swap_bytes = htons(1) != 1;
+  }
+  if (channels == 1 && is_gray) {
+    memcpy(f->swizzle, gray, sizeof(gray));
+  } else if (channels == 2) {
+    memcpy(f->swizzle, gray_alpha, sizeof(gray_alpha));
+  }
+}
+
+void upload_tex_params(const TEX_FORMAT *f) {
+  glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, f->swizzle);
+}
+
+void upload_unpack(const TEX_FORMAT *f, bool uploading) {
+  if (f->swap_bytes) {
+    glPixelStorei(GL_UNPACK_SWAP_BYTES, uploading ? GL_TRUE : GL_FALSE);
+  }
+}
+
+/**
+ * Allocates the texture storage for "png" and the pixel buffer object.
+ * Returns false if either failed, or the image doesn't fit in one texture,
+ * in which case the decoder is left to allocate the pixels itself.
+ */
+static bool start_upload(UPLOAD *up, const PNG *png) {
+  upload_format(png, &up->format);
+  uint32_t ppt = up->format.pixels_per_texel;
+  up->width = (png->header->width + ppt - 1) / ppt;
+  up->height = png->header->height;
+  up->row_size = PNG_row_size(png);
+  GLint max_size = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+  if (up->width > (uint32_t)max_size || up->height > (uint32_t)max_size) {
+    // needs tiles, which are cut from the decoded image afterwards
+    return false;
+  }
+  up->band_rows = up->row_size < UPLOAD_BAND_SIZE
+                      ? (uint32_t)(UPLOAD_BAND_SIZE / up->row_size)
+                      : 1;
+  if (up->band_rows > up->height) {
+    up->band_rows = up->height;
+  }
+  while (glGetError() != GL_NO_ERROR) {
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  upload_tex_params(&up->format);
+  glTexImage2D(GL_TEXTURE_2D, 0, up->format.internal, (GLsizei)up->width,
+               (GLsizei)up->height, 0, up->format.format, up->format.type,
+               NULL);
+  glGenBuffers(1, &up->pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->pbo);
+  GLenum err = glGetError();
+  if (err != GL_NO_ERROR) {
+    // left bound, a pointer given to glTexImage2D would be taken as an offset
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    fprintf(stderr, "Unable to stream the image, GL error 0x%x.\n", err);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Unmaps the band being written and queues its copy into the texture, rows
+ * "up->band_start" up to "end".
+ */
+static void finish_band(UPLOAD *up, uint32_t end) {
+  up->mapped = false;
+  if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE) {
+    // the buffer was lost while mapped, rare enough to just say so
+    fprintf(stderr, "Pixel buffer lost, rows %u to %u are missing.\n",
+            up->band_start, end);
+    return;
+  }
+  upload_unpack(&up->format, true);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint)up->band_start,
+                  (GLsizei)up->width, (GLsizei)(end - up->band_start),
+                  up->format.format, up->format.type, (void *)0);
+  upload_unpack(&up->format, false);
+  if (up->stats) {
+    up->stats->stages[PNG_STAGE_UPLOAD].bytes +=
+        (uint64_t)(end - up->band_start) * up->row_size;
+  }
+}
+
+/**
+ * Orphans the buffer and maps it for the band starting at "row".
+ * Returns NULL if it could not be mapped.
+ */
+static uint8_t *map_band(UPLOAD *up, uint32_t row, uint32_t *num_rows) {
+  uint32_t rows = up->height - row;
+  if (rows > up->band_rows) {
+    rows = up->band_rows;
+  }
+  GLsizeiptr size = (GLsizeiptr)((size_t)up->band_rows * up->row_size);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  void *p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                             (GLsizeiptr)((size_t)rows * up->row_size),
+                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (!p) {
+    return NULL;
+  }
+  up->band_start = row;
+  up->mapped = true;
+  *num_rows = rows;
+  return p;
+}
+
+/**
+ * PNG_OutputFn handing out bands of the pixel buffer object.
+ */
+static uint8_t *upload_rows(void *user, const PNG *png, uint32_t row,
+                            size_t *stride, uint32_t *num_rows) {
+  UPLOAD *up = user;
+  uint64_t start = up->stats ? PNG_stats_clock() : 0;
+  glBindTexture(GL_TEXTURE_2D, up->tex);
+  uint8_t *pixels = NULL;
+  if (row == 0 && !start_upload(up, png)) {
+    return NULL;
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->pbo);
+  if (up->mapped) {
+    finish_band(up, row);
+  }
+  if (row < up->height) {
+    pixels = map_band(up, row, num_rows);
+    *stride = up->row_size;
+    if (!pixels && row > 0) {
+      fprintf(stderr, "Unable to map the pixel buffer for row %u.\n", row);
+    }
+  }
+  if (row == 0) {
+    up->streamed = pixels != NULL;
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (up->stats) {
+    up->stats->stages[PNG_STAGE_UPLOAD].ns += PNG_stats_clock() - start;
+  }
+  return pixels;
+}
+
+void upload_init(UPLOAD *up, PNG_Options *opts, PNG_Stats *stats) {
+  memset(up, 0, sizeof(UPLOAD));
+  up->stats = stats;
+  glGenTextures(1, &up->tex);
+  opts->output = upload_rows;
+  opts->output_user = up;
+}
+
+void upload_free(UPLOAD *up) {
+  if (up->pbo) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->pbo);
+    if (up->mapped) {
+      // a decode that failed part way through
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      up->mapped = false;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &up->pbo);
+    up->pbo = 0;
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+#include "png.h"
+#include <glad/gl.h>
+
+/**
+ * How the pixels of a PNG are held in a texture.  Rows packed several
+ * pixels to a byte, "pixels_per_texel" of them, are uploaded a byte per
+ * texel to an integer texture for the shader to unpack.  Gray is kept in
+ * the red channel, and alpha in green, and "swizzle" spreads it back out to
+ * RGBA when the texture is sampled.  16 bit samples are big-endian, so
+ * "swap_bytes" is set on little-endian machines for GL_UNPACK_SWAP_BYTES.
+ */
+typedef struct {
+  GLint internal;
+  GLenum format;
+  GLenum type;
+  uint32_t pixels_per_texel;
+  size_t bytes_per_texel;
+  GLint swizzle[4];
+  bool swap_bytes;
+} TEX_FORMAT;
+
+/**
+ * Streams an image into a texture while it is being decoded.  The decoder
+ * writes each band of rows straight into a mapped pixel buffer object, and
+ * once a band is complete it is unmapped and handed to glTexSubImage2D, which
+ * copies it to the texture asynchronously while the next band is decoded.
+ * The buffer is orphaned before every band so mapping it never waits on the
+ * copy of the band before.
+ * Field "tex" is the texture.  Field "streamed" is set once the first band
+ * has been mapped, if it isn't the decoder fell back to its own memory, as
+ * it does for images larger than GL_MAX_TEXTURE_SIZE, and the texture is
+ * left empty.
+ */
+typedef struct {
+  GLuint tex;
+  GLuint pbo;
+  PNG_Stats *stats;
+  uint32_t width; // in texels
+  uint32_t height;
+  TEX_FORMAT format;
+  size_t row_size;
+  uint32_t band_rows;
+  uint32_t band_start;
+  bool mapped;
+  bool streamed;
+} UPLOAD;
+
+/**
+ * Sets "f" to the texture format for the pixels of "png", going by
+ * PNG_channels and PNG_depth.
+ */
+void upload_format(const PNG *png, TEX_FORMAT *f);
+/**
+ * Sets the parameters of the bound texture that depend on "f".
+ */
+void upload_tex_params(const TEX_FORMAT *f);
+/**
+ * Sets the unpack state that "f" needs before pixels are uploaded, or puts
+ * it back as it was if "uploading" is false.
+ */
+void upload_unpack(const TEX_FORMAT *f, bool uploading);
+/**
+ * Creates the texture, which needs a current GL context, and points "opts"
+ * at "up" so decodes with it stream into the texture.  Upload time and bytes
+ * are added to "stats" if it isn't NULL.
+ */
+void upload_init(UPLOAD *up, PNG_Options *opts, PNG_Stats *stats);
+/**
+ * Deletes the pixel buffer object.  The texture is left to the caller.
+ */
+void upload_free(UPLOAD *up);
+
+#endif // UPLOAD_H